@@ -0,0 +1,172 @@
+// Copyright (C) 2021 Stuart Duncan
+//
+// This file is part of PicoRPC.
+//
+// PicoRPC is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// PicoRPC is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with PicoRPC.  If not, see <http://www.gnu.org/licenses/>.
+
+// Measures caller::call -> invoker::invoke over an in-process transport, the same
+// as the dummy transport in test/prpc.cpp, and over the shared-memory transport to an
+// invoker on another thread, and the invoker's function registry on its own. Prints one
+// JSON object per benchmark:
+//   prpc_bench [iterations] [filter]
+// runs each benchmark for iterations calls (default 100000), and only the
+// benchmarks whose name contains filter.
+
+#include "prpc.hpp"
+#include "prpc_shm.hpp"
+#include <chrono>
+#include <cstdio>
+#include <vector>
+#include <algorithm>
+#include <thread>
+#include <atomic>
+
+using clock_type = std::chrono::steady_clock;
+
+int get_int(){ return 42; }
+int add_one(int n){ return n + 1; }
+double scale(double d){ return d * 1.5; }
+string echo(string s){ return s; }
+std::size_t length(std::string_view s){ return s.size(); }
+int sum8(int a, int b, int c, int d, double e, double f, string g, string h){
+  return a + b + c + d + int(e + f) + int(g.size() + h.size());
+}
+
+struct bench_transport{
+  prpc::invoker invoker;
+  string buffer;
+  bench_transport(prpc::wire_format format) : invoker([this](string msg){ buffer = std::move(msg); }, format) {
+    invoker.add("get_int", get_int);
+    invoker.add("add_one", add_one);
+    invoker.add("scale", scale);
+    invoker.add("echo", echo);
+    invoker.add("length", length);
+    invoker.add("sum8", sum8);
+  }
+  string sendrec(string msg){
+    invoker.invoke(msg);
+    return buffer;
+  }
+  void sendrec_view(std::string_view msg, string &response){
+    invoker.invoke(msg, response);
+  }
+};
+
+char const *format_name(prpc::wire_format format){
+  return format == prpc::wire_format::binary ? "binary" : "text";
+}
+
+template <typename CALL_T>
+void run(char const *name, char const *transport, prpc::wire_format format, std::size_t iterations, std::size_t payload_bytes, CALL_T call){
+  for(std::size_t i = 0; i < iterations / 10 + 1; i++) call();
+
+  std::vector<double> latency_ns(iterations);
+  auto start = clock_type::now();
+  for(std::size_t i = 0; i < iterations; i++){
+    auto call_start = clock_type::now();
+    call();
+    latency_ns[i] = std::chrono::duration<double, std::nano>(clock_type::now() - call_start).count();
+  }
+  double seconds = std::chrono::duration<double>(clock_type::now() - start).count();
+
+  std::sort(latency_ns.begin(), latency_ns.end());
+  auto percentile = [&latency_ns](double p){ return latency_ns[std::min(latency_ns.size() - 1, std::size_t(p * latency_ns.size()))]; };
+  std::printf("{\"name\": \"%s\", \"format\": \"%s\", \"transport\": \"%s\", \"payload_bytes\": %zu, \"iterations\": %zu, "
+              "\"calls_per_sec\": %.1f, \"p50_ns\": %.1f, \"p99_ns\": %.1f}\n",
+              name, format_name(format), transport, payload_bytes, iterations, iterations / seconds, percentile(0.5), percentile(0.99));
+  std::fflush(stdout);
+}
+
+// Runs every benchmark over the caller in each transport
+void run_all(prpc::wire_format format, std::size_t iterations, string const &filter){
+  bench_transport transport(format);
+  prpc::caller string_caller([&transport](string msg){ return transport.sendrec(std::move(msg)); }, format);
+  prpc::caller view_caller([&transport](std::string_view msg, string &response){ transport.sendrec_view(msg, response); }, format);
+
+  auto shm_server = prpc::shm_channel::create();
+  std::thread shm_thread([&shm_server, format]{
+    bench_transport shm_transport(format);
+    string request, response;
+    while(shm_server.receive(request)){
+      shm_transport.sendrec_view(request, response);
+      shm_server.send(response);
+    }
+  });
+  auto shm_client = prpc::shm_channel::open(shm_server.get_fd());
+  prpc::caller shm_caller([&shm_client](std::string_view msg, string &response){ shm_client.sendrec(msg, response); }, format);
+
+  string short_str = "short string";
+  string long_str(64 * 1024, 'x');
+  volatile std::size_t sink = 0;
+
+  for(auto [transport_name, caller] : {std::pair<char const *, prpc::caller*>{"string", &string_caller}, {"view", &view_caller},
+                                        {"shm", &shm_caller}}){
+    auto bench = [&](char const *name, std::size_t payload_bytes, auto call){
+      if(string(name).find(filter) == string::npos) return;
+      run(name, transport_name, format, iterations, payload_bytes, call);
+    };
+    bench("int_void", 0, [&]{ int r = caller->call("get_int"); sink = r; });
+    bench("int_int", sizeof(int), [&]{ int r = caller->call("add_one", 1); sink = r; });
+    bench("double_double", sizeof(double), [&]{ double r = caller->call("scale", 0.1); sink = std::size_t(r); });
+    bench("string_short", short_str.size(), [&]{ string r = caller->call("echo", short_str); sink = r.size(); });
+    bench("string_64k", long_str.size(), [&]{ string r = caller->call("echo", long_str); sink = r.size(); });
+    bench("string_view_64k", long_str.size(), [&]{ std::size_t r = caller->call("length", std::string_view(long_str)); sink = r; });
+    bench("args_8", 4 * sizeof(int) + 2 * sizeof(double) + 2 * short_str.size(),
+          [&]{ int r = caller->call("sum8", 1, 2, 3, 4, 0.5, 0.5, short_str, short_str); sink = r; });
+  }
+  shm_client.close();
+  shm_thread.join();
+}
+
+// Adding functions one at a time, and lookups while other threads are looking up too
+void run_registry(prpc::wire_format format, std::size_t iterations, string const &filter){
+  if(string("add_function").find(filter) != string::npos){
+    prpc::invoker invoker([](string){}, format);
+    std::size_t added = 0;
+    run("add_function", "registry", format, iterations, 0, [&]{ invoker.add("fun_" + std::to_string(added++), get_int); });
+  }
+  if(string("lookup_contended").find(filter) != string::npos){
+    bench_transport transport(format);
+    for(int i = 0; i < 10000; i++) transport.invoker.add("fun_" + std::to_string(i), get_int);
+    string message;
+    prpc::caller message_caller([&](std::string_view msg, string &response){
+      message = msg;
+      transport.sendrec_view(msg, response);
+    }, format);
+    message_caller.call("add_one", 1);
+
+    // Each thread has its own response buffer, for the thread-safe invoke overload
+    std::atomic<bool> stop{false};
+    std::vector<std::thread> others;
+    for(int t = 0; t < 3; t++){
+      others.emplace_back([&]{
+        prpc::serial_buffer response;
+        while(!stop) transport.invoker.invoke(message, response);
+      });
+    }
+    prpc::serial_buffer response;
+    run("lookup_contended", "registry", format, iterations, 0, [&]{ transport.invoker.invoke(message, response); });
+    stop = true;
+    for(auto &other : others) other.join();
+  }
+}
+
+int main(int argc, char *argv[]){
+  std::size_t iterations = argc > 1 ? std::stoul(argv[1]) : 100000;
+  string filter = argc > 2 ? argv[2] : "";
+  run_all(prpc::wire_format::text, iterations, filter);
+  run_all(prpc::wire_format::binary, iterations, filter);
+  run_registry(prpc::wire_format::text, iterations, filter);
+  run_registry(prpc::wire_format::binary, iterations, filter);
+}
@@ -16,16 +16,48 @@
 // along with picoRPC.  If not, see <http://www.gnu.org/licenses/>.
 
 #pragma once
-#include <any>
 #include <map>
+#include <vector>
+#include <limits>
+#include <charconv>
 #include <tuple>
+#include <array>
 #include <string>
 #include <iomanip>
 #include <cassert>
+#include <cstdint>
+#include <cstring>
+#include <climits>
+#include <memory_resource>
 #include <sstream>
 #include <optional>
+#include <algorithm>
+#include <string_view>
+#include <forward_list>
 #include <exception>
+#include <stdexcept>
 #include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <deque>
+#include <thread>
+#include <atomic>
+#include <condition_variable>
+#include <unordered_map>
+#include <list>
+#include <chrono>
+#include <utility>
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+// Coroutine functions and awaited calls need C++20
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+#include <coroutine>
+#define PRPC_HAS_COROUTINES 1
+#else
+#define PRPC_HAS_COROUTINES 0
+#endif
 
 using std::map;
 using std::string;
@@ -38,8 +70,49 @@ namespace prpc{
   template <typename T> constexpr bool _is_tuple = false;
   template <typename ... T> constexpr bool _is_tuple<std::tuple<T...>>   = true;
 
+  // Arithmetic types that the binary wire format sends as fixed-width little-endian
+  template <typename T> constexpr bool _is_fixed_width = std::is_arithmetic_v<T> &&
+    (sizeof(T) == 1 || sizeof(T) == 2 || sizeof(T) == 4 || sizeof(T) == 8);
+  template <std::size_t N> struct _uint_of_size;
+  template <> struct _uint_of_size<1>{ using type = std::uint8_t; };
+  template <> struct _uint_of_size<2>{ using type = std::uint16_t; };
+  template <> struct _uint_of_size<4>{ using type = std::uint32_t; };
+  template <> struct _uint_of_size<8>{ using type = std::uint64_t; };
+  // Numbers the text format writes with to_chars and reads with from_chars. Character
+  // types and bool keep going through the stream, which prints them as characters/0/1.
+  template <typename T> constexpr bool _is_charconv = (std::is_integral_v<T> || std::is_floating_point_v<T>) &&
+    !std::is_same_v<T, bool> && !std::is_same_v<T, char> && !std::is_same_v<T, signed char> &&
+    !std::is_same_v<T, unsigned char> && !std::is_same_v<T, wchar_t> &&
+    !std::is_same_v<T, char16_t> && !std::is_same_v<T, char32_t>;
+
   typedef std::function<void(string)> transport_send_f;
   typedef std::function<string(string)> transport_sendrec_f;
+  // Sends a caller-owned message and writes the reply into a caller-owned buffer
+  typedef std::function<void(std::string_view, string&)> transport_sendrec_view_f;
+
+  // Dense numeric function ID assigned by invoker::add, in registration order.
+  // On the wire it replaces the function ID string: '#' followed by the decimal
+  // number in text, or an empty string followed by a varint in binary.
+  typedef std::uint32_t fun_num_t;
+  // Correlation ID tagging a request so its response can be matched to it. On the
+  // wire it comes before the function ID: '@' followed by the decimal number in
+  // text, or the string "@" followed by a varint in binary. The invoker echoes it
+  // in front of the response status.
+  typedef std::uint64_t corr_id_t;
+
+  template <typename T>
+  bool _parse_num(std::string_view str, T &value){
+    auto end = str.data() + str.size();
+    auto [ptr, ec] = std::from_chars(str.data(), end, value);
+    return ec == std::errc() && ptr == end;
+  }
+
+  // text is the human-readable default (space separated, strings std::quoted).
+  // binary sends the prefix and strings as a varint length followed by raw bytes
+  // and arithmetic values as fixed-width little-endian. Other types are formatted
+  // with operator<< and sent as a binary string. Both ends of a connection have
+  // to agree on the format.
+  enum class wire_format{ text, binary };
 
   struct UnknownFunctionException : public std::exception {
     const char * what() const throw ()
@@ -62,97 +135,1058 @@ namespace prpc{
 
   class invoker;
   class caller;
+  class async_caller;
+  class pool_invoker;
+  class queue_invoker;
+  template <auto ... FUNS> class static_invoker;
+
+  template <typename> struct _fun_ptr_signature;
+  template <typename R, typename ... T> struct _fun_ptr_signature<R(*)(T ... )>{
+    using ret_t = std::decay_t<R>;
+    using args_tupl_t = std::tuple<std::decay_t<T> ... >;
+  };
+  class call_return;
+
+  // Containers and other composites are sent element by element: a count first for
+  // vectors and maps, a 0/1 flag first for optionals. Vectors and arrays of
+  // fixed-width arithmetic types are one block of bytes in the binary format.
+  template <typename T> constexpr bool _is_vector = false;
+  template <typename T, typename A> constexpr bool _is_vector<std::vector<T, A>> = true;
+  template <typename T> constexpr bool _is_array = false;
+  template <typename T, std::size_t N> constexpr bool _is_array<std::array<T, N>> = true;
+  template <typename T> constexpr bool _is_map = false;
+  template <typename K, typename V, typename C, typename A> constexpr bool _is_map<std::map<K, V, C, A>> = true;
+  template <typename K, typename V, typename H, typename E, typename A> constexpr bool _is_map<std::unordered_map<K, V, H, E, A>> = true;
+  template <typename T> constexpr bool _is_optional = false;
+  template <typename T> constexpr bool _is_optional<std::optional<T>> = true;
+  template <typename T> constexpr bool _is_pair = false;
+  template <typename T1, typename T2> constexpr bool _is_pair<std::pair<T1, T2>> = true;
+  template <typename T> constexpr bool _is_composite =
+    _is_vector<T> || _is_array<T> || _is_map<T> || _is_optional<T> || _is_pair<T> || _is_tuple<T>;
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  template <typename T> constexpr bool _is_bulk = _is_fixed_width<T> && !std::is_same_v<T, bool>;
+#else
+  template <typename T> constexpr bool _is_bulk = false;
+#endif
+
+  template <typename T> constexpr bool _is_string_like =
+    std::is_same_v<std::decay_t<T>, std::string> || std::is_same_v<std::decay_t<T>, std::string_view>;
+
+  // First '"' or '\\' in [begin, end), or end. Checks 32 bytes per step with AVX2 and
+  // 16 with SSE2, so long strings without specials are scanned at memory speed.
+  inline char const *_find_quote_or_escape(char const *begin, char const *end){
+#if defined(__AVX2__)
+    __m256i const quote32 = _mm256_set1_epi8('"'), escape32 = _mm256_set1_epi8('\\');
+    for(; end - begin >= 32; begin += 32){
+      __m256i chunk = _mm256_loadu_si256(reinterpret_cast<__m256i const*>(begin));
+      unsigned mask = unsigned(_mm256_movemask_epi8(_mm256_or_si256(
+            _mm256_cmpeq_epi8(chunk, quote32), _mm256_cmpeq_epi8(chunk, escape32))));
+      if(mask != 0) return begin + __builtin_ctz(mask);
+    }
+#endif
+#if defined(__SSE2__)
+    __m128i const quote16 = _mm_set1_epi8('"'), escape16 = _mm_set1_epi8('\\');
+    for(; end - begin >= 16; begin += 16){
+      __m128i chunk = _mm_loadu_si128(reinterpret_cast<__m128i const*>(begin));
+      unsigned mask = unsigned(_mm_movemask_epi8(_mm_or_si128(
+            _mm_cmpeq_epi8(chunk, quote16), _mm_cmpeq_epi8(chunk, escape16))));
+      if(mask != 0) return begin + __builtin_ctz(mask);
+    }
+#endif
+    for(; begin != end; ++begin)
+      if(*begin == '"' || *begin == '\\') return begin;
+    return end;
+  }
+  // Same output as std::quoted, without the temporary ostringstream it builds. Clean
+  // runs between specials are written in one go.
+  inline void _insert_quoted(std::ostream &strm, std::string_view value){
+    strm.put('"');
+    char const *run = value.data(), *end = value.data() + value.size();
+    while(run != end){
+      char const *special = _find_quote_or_escape(run, end);
+      strm.write(run, special - run);
+      if(special == end) break;
+      strm.put('\\');
+      strm.put(*special);
+      run = special + 1;
+    }
+    strm.put('"');
+  }
+
+  // Reads a caller-owned message in place
+  class _view_buf : public std::streambuf{
+    public:
+      _view_buf(std::string_view view){
+        char *begin = const_cast<char*>(view.data());
+        setg(begin, begin, begin + view.size());
+      }
+      std::string_view remaining() const {return std::string_view(gptr(), egptr() - gptr()); }
+      std::size_t size() const {return egptr() - eback(); }
+      void advance(std::size_t n){ setg(eback(), gptr() + n, egptr()); }
+  };
+  // Contiguous growable buffer that to_serial writes messages into. reset() keeps the
+  // storage, so a buffer reused across calls stops allocating once it is big enough.
+  // The storage comes from a memory_resource, e.g. a std::pmr::monotonic_buffer_resource
+  // over a stack array as an arena.
+  class serial_buffer : public std::streambuf{
+      std::pmr::memory_resource *resource;
+      void grow(std::size_t min_capacity){
+        std::size_t old_size = size();
+        std::size_t new_capacity = std::max({min_capacity, 2 * capacity(), std::size_t(64)});
+        char *new_data = static_cast<char*>(resource->allocate(new_capacity, 1));
+        if(old_size != 0) std::memcpy(new_data, pbase(), old_size);
+        release();
+        setp(new_data, new_data + new_capacity);
+        advance(old_size);
+      }
+      void release(){
+        if(pbase() != nullptr) resource->deallocate(pbase(), capacity(), 1);
+      }
+      void advance(std::size_t n){
+        for(; n > std::size_t(INT_MAX); n -= INT_MAX) pbump(INT_MAX);
+        pbump(int(n));
+      }
+    protected:
+      int_type overflow(int_type c) override {
+        if(traits_type::eq_int_type(c, traits_type::eof())) return traits_type::not_eof(c);
+        grow(size() + 1);
+        *pptr() = traits_type::to_char_type(c);
+        pbump(1);
+        return c;
+      }
+      std::streamsize xsputn(char const *s, std::streamsize n) override {
+        if(n <= 0) return 0;
+        if(std::size_t(epptr() - pptr()) < std::size_t(n)) grow(size() + n);
+        std::memcpy(pptr(), s, n);
+        advance(n);
+        return n;
+      }
+    public:
+      explicit serial_buffer(std::pmr::memory_resource *_resource = std::pmr::get_default_resource()) : resource(_resource) {}
+      serial_buffer(serial_buffer const &) = delete;
+      serial_buffer &operator=(serial_buffer const &) = delete;
+      ~serial_buffer(){ release(); }
+
+      void reset(){ setp(pbase(), epptr()); }
+      void reserve(std::size_t new_capacity){ if(new_capacity > capacity()) grow(new_capacity); }
+      std::size_t size() const {return pptr() - pbase(); }
+      std::size_t capacity() const {return epptr() - pbase(); }
+      char const *data() const {return pbase(); }
+      std::string_view view() const {return std::string_view(pbase(), size()); }
+  };
+
+  // Chunks of one streamed argument on their way from invoke to the function reading them.
+  // push blocks while capacity chunks are waiting, so a fast sender can't fill memory.
+  class _chunk_channel{
+    static constexpr std::size_t capacity = 4;
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::deque<string> chunks;
+    bool ended = false;
+    bool finished = false;
+    public:
+      void push(string chunk){
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [this]{ return finished || chunks.size() < capacity; });
+        if(finished) return;
+        chunks.push_back(std::move(chunk));
+        cv.notify_all();
+      }
+      // No more chunks are coming
+      void end(){
+        std::lock_guard<std::mutex> lock(mutex);
+        ended = true;
+        cv.notify_all();
+      }
+      // The function returned, chunks it didn't read and any still to come are dropped
+      void finish(){
+        std::lock_guard<std::mutex> lock(mutex);
+        finished = true;
+        chunks.clear();
+        cv.notify_all();
+      }
+      bool is_finished(){
+        std::lock_guard<std::mutex> lock(mutex);
+        return finished;
+      }
+      bool pop(string &chunk){
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [this]{ return ended || !chunks.empty(); });
+        if(chunks.empty()) return false;
+        chunk = std::move(chunks.front());
+        chunks.pop_front();
+        cv.notify_all();
+        return true;
+      }
+  };
+  // Parameter type for a streamed argument, e.g.
+  //   std::size_t count_bytes(prpc::chunk_range data){ ... for(std::string_view chunk : data) ... }
+  // An input range of the chunks, received while the function iterates over it, so only a
+  // few chunks are in memory at a time. It can be iterated once. Take it by value.
+  class chunk_range{
+    friend class from_serial;
+    std::shared_ptr<_chunk_channel> channel;
+    string current;
+    bool started = false;
+    bool done = false;
+
+    void next(){ done = !channel || !channel->pop(current); }
+    public:
+      class iterator{
+        chunk_range *range;
+        bool at_end() const {return range == nullptr || range->done; }
+        public:
+          using iterator_category = std::input_iterator_tag;
+          using value_type = std::string_view;
+          using difference_type = std::ptrdiff_t;
+          using pointer = void;
+          using reference = std::string_view;
+
+          explicit iterator(chunk_range *_range = nullptr) : range(_range) {}
+          std::string_view operator*() const {return range->current; }
+          iterator &operator++(){ range->next(); return *this; }
+          void operator++(int){ range->next(); }
+          bool operator==(iterator const &other) const {return at_end() == other.at_end(); }
+          bool operator!=(iterator const &other) const {return at_end() != other.at_end(); }
+      };
+      iterator begin(){
+        if(!started){
+          started = true;
+          next();
+        }
+        return iterator(this);
+      }
+      iterator end(){ return iterator(); }
+  };
+  // Argument or return type for a payload that is sent as a sequence of messages, one per
+  // chunk, instead of one big message. next writes the next chunk into its argument and
+  // returns false after the last one.
+  class chunk_source{
+    function<bool(string&)> next;
+    public:
+      chunk_source() = default;
+      chunk_source(function<bool(string&)> _next) : next(std::move(_next)) {}
+      // Chunks of at most chunk_size bytes of data, which has to outlive the chunk_source
+      static chunk_source split(std::string_view data, std::size_t chunk_size = 65536){
+        chunk_size = std::max<std::size_t>(chunk_size, 1);
+        return chunk_source([data, chunk_size](string &chunk) mutable {
+          if(data.empty()) return false;
+          chunk.assign(data.data(), std::min(chunk_size, data.size()));
+          data.remove_prefix(chunk.size());
+          return true;
+        });
+      }
+      bool operator()(string &chunk) const {return next && next(chunk); }
+  };
+  template <typename T> constexpr bool _has_chunk_range = false;
+  template <typename ... T> constexpr bool _has_chunk_range<std::tuple<T...>> =
+    (std::is_same_v<std::decay_t<T>, chunk_range> || ...);
+  template <typename T> constexpr bool _has_chunk_source = false;
+  template <typename ... T> constexpr bool _has_chunk_source<std::tuple<T...>> =
+    (std::is_same_v<std::decay_t<T>, chunk_source> || ...);
+  template <typename T> constexpr bool _is_task = false;
+
+#if PRPC_HAS_COROUTINES
+  template <typename T = void> class task;
+  template <typename T> constexpr bool _is_task<task<T>> = true;
+
+  struct _task_promise_base{
+    // Resumed when the task finishes
+    std::coroutine_handle<> continuation = std::noop_coroutine();
+    std::exception_ptr error;
+
+    struct final_awaiter{
+      bool await_ready() const noexcept {return false; }
+      template <typename P>
+      std::coroutine_handle<> await_suspend(std::coroutine_handle<P> handle) noexcept {return handle.promise().continuation; }
+      void await_resume() const noexcept {}
+    };
+    std::suspend_always initial_suspend() const noexcept {return {}; }
+    final_awaiter final_suspend() const noexcept {return {}; }
+    void unhandled_exception(){ error = std::current_exception(); }
+  };
+  template <typename T>
+  struct _task_promise : _task_promise_base{
+    std::optional<T> value;
+
+    task<T> get_return_object();
+    template <typename U>
+    void return_value(U &&_value){ value.emplace(std::forward<U>(_value)); }
+    T result(){
+      if(error) std::rethrow_exception(error);
+      return std::move(*value);
+    }
+  };
+  template <>
+  struct _task_promise<void> : _task_promise_base{
+    task<void> get_return_object();
+    void return_void(){}
+    void result(){ if(error) std::rethrow_exception(error); }
+  };
+  // Return type of a coroutine, e.g. of a function added to an invoker that awaits I/O of
+  // its own instead of blocking a thread:
+  //   prpc::task<string> lookup(string key){ co_return co_await store.get(key); }
+  // It starts when it is awaited and resumes its awaiter when it finishes, on whichever
+  // thread finished it.
+  template <typename T>
+  class task{
+    friend struct _task_promise<T>;
+    std::coroutine_handle<_task_promise<T>> handle;
+
+    explicit task(std::coroutine_handle<_task_promise<T>> _handle) : handle(_handle) {}
+    public:
+      using promise_type = _task_promise<T>;
+      using value_type = T;
+
+      task(task &&other) noexcept : handle(std::exchange(other.handle, {})) {}
+      task &operator=(task &&other) noexcept {
+        if(this != &other){
+          if(handle) handle.destroy();
+          handle = std::exchange(other.handle, {});
+        }
+        return *this;
+      }
+      ~task(){ if(handle) handle.destroy(); }
+
+      auto operator co_await() noexcept {
+        struct awaiter{
+          std::coroutine_handle<_task_promise<T>> handle;
+          bool await_ready() const noexcept {return handle.done(); }
+          std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept {
+            handle.promise().continuation = awaiting;
+            return handle;
+          }
+          T await_resume(){ return handle.promise().result(); }
+        };
+        return awaiter{handle};
+      }
+  };
+  template <typename T>
+  task<T> _task_promise<T>::get_return_object(){ return task<T>(std::coroutine_handle<_task_promise<T>>::from_promise(*this)); }
+  inline task<void> _task_promise<void>::get_return_object(){ return task<void>(std::coroutine_handle<_task_promise<void>>::from_promise(*this)); }
+
+  // Coroutine that runs as soon as it is called and frees itself when it finishes, for
+  // starting a task from code that isn't a coroutine
+  struct _detached{
+    struct promise_type{
+      _detached get_return_object() const noexcept {return {}; }
+      std::suspend_never initial_suspend() const noexcept {return {}; }
+      std::suspend_never final_suspend() const noexcept {return {}; }
+      void return_void() const noexcept {}
+      void unhandled_exception() const noexcept { std::terminate(); }
+    };
+  };
+
+  // Single-threaded loop that resumes coroutines, enough to run coroutine functions and
+  // awaited calls in a test or a simple server. post can be called from any thread, the
+  // work runs on the thread calling run.
+  class event_loop{
+    std::mutex mutex;
+    std::deque<function<void()>> ready;
+    public:
+      void post(function<void()> work){
+        std::lock_guard<std::mutex> lock(mutex);
+        ready.push_back(std::move(work));
+      }
+      // co_await loop.yield() suspends the coroutine until run gets to it, after the work
+      // posted before it
+      auto yield(){
+        struct awaiter{
+          event_loop &loop;
+          bool await_ready() const noexcept {return false; }
+          void await_suspend(std::coroutine_handle<> handle){ loop.post([handle]{ handle.resume(); }); }
+          void await_resume() const noexcept {}
+        };
+        return awaiter{*this};
+      }
+      // Starts t from run. It is freed when it finishes, an exception leaving it terminates.
+      void spawn(task<> t){
+        [](event_loop &loop, task<> t) -> _detached {
+          co_await loop.yield();
+          co_await t;
+        }(*this, std::move(t));
+      }
+      // Runs the posted work, and the work that posts, until there is none left. Returns
+      // how much ran.
+      std::size_t run(){
+        std::size_t count = 0;
+        for(;;){
+          function<void()> work;
+          {
+            std::lock_guard<std::mutex> lock(mutex);
+            if(ready.empty()) return count;
+            work = std::move(ready.front());
+            ready.pop_front();
+          }
+          work();
+          ++count;
+        }
+      }
+  };
+#endif
 
   class serial_message{
     protected:
       string prefix_str;
-    public:
-      std::stringstream msg_strm;
-      string serial(){return msg_strm.str(); }
-      bool has_conv_failed(){return msg_strm.fail() || (msg_strm.rdbuf()->in_avail() != 0); }
+      std::optional<fun_num_t> prefix_num;
+      std::optional<corr_id_t> corr_id;
+      wire_format format = wire_format::text;
   };
 
   class from_serial : public serial_message{
     protected:
       friend class invoker;
       friend class caller;
+      friend class async_caller;
+      friend class call_return;
+      template <auto ... FUNS> friend class static_invoker;
+      _view_buf view_buf;
+      std::istream msg_strm;
+      // Storage for string_view args that had escapes to remove
+      std::forward_list<string> unquoted;
+      // Chunks of a streamed call's chunk_range argument, set by the invoker
+      std::shared_ptr<_chunk_channel> chunks;
+
       template <typename ... T, std::size_t ... I>
       void extract_args_tuple( std::tuple<T ... > &tuple, std::index_sequence<I ... >){
         (extract_arg_value(std::get<I>(tuple)) , ... );
       }
       template <typename T> std::enable_if_t<std::is_same_v<T, std::string>, void>
       extract_arg_value(T &value){
-        msg_strm >> std::quoted(value);
+        if(format == wire_format::binary) extract_binary(value);
+        else extract_quoted(value);
       }
-      template <typename T> std::enable_if_t<!std::is_same_v<T, std::string>, void>
+      template <typename T> std::enable_if_t<!_is_string_like<T> && !_is_composite<T>, void>
       extract_arg_value(T &value){
-        msg_strm >> value;
+        if(format == wire_format::binary) extract_binary(value);
+        else if constexpr (_is_charconv<T>) extract_number(value);
+        else msg_strm >> value;
+      }
+      template <typename T> std::enable_if_t<_is_vector<T>, void>
+      extract_arg_value(T &value){
+        using elem_t = typename T::value_type;
+        auto count = extract_count();
+        value.clear();
+        if(msg_strm.fail()) return;
+        if constexpr (_is_bulk<elem_t>){
+          if(format == wire_format::binary){
+            if(count > view_buf.remaining().size() / sizeof(elem_t)){
+              msg_strm.setstate(std::ios::failbit);
+              return;
+            }
+            value.resize(count);
+            msg_strm.read(reinterpret_cast<char*>(value.data()), count * sizeof(elem_t));
+            return;
+          }
+        }
+        value.reserve(count);
+        for(std::uint64_t i = 0; i < count && !msg_strm.fail(); i++){
+          elem_t elem{};
+          extract_arg_value(elem);
+          value.push_back(std::move(elem));
+        }
+      }
+      template <typename T> std::enable_if_t<_is_array<T>, void>
+      extract_arg_value(T &value){
+        using elem_t = typename T::value_type;
+        if constexpr (_is_bulk<elem_t>){
+          if(format == wire_format::binary){
+            msg_strm.read(reinterpret_cast<char*>(value.data()), value.size() * sizeof(elem_t));
+            return;
+          }
+        }
+        for(auto &elem : value) extract_arg_value(elem);
+      }
+      template <typename T> std::enable_if_t<_is_map<T>, void>
+      extract_arg_value(T &value){
+        auto count = extract_count();
+        value.clear();
+        for(std::uint64_t i = 0; i < count && !msg_strm.fail(); i++){
+          typename T::key_type key{};
+          typename T::mapped_type mapped{};
+          extract_arg_value(key);
+          extract_arg_value(mapped);
+          value.emplace(std::move(key), std::move(mapped));
+        }
+      }
+      template <typename T> std::enable_if_t<_is_optional<T>, void>
+      extract_arg_value(T &value){
+        bool has_value = false;
+        extract_arg_value(has_value);
+        value.reset();
+        if(has_value){
+          typename T::value_type contained{};
+          extract_arg_value(contained);
+          value = std::move(contained);
+        }
+      }
+      template <typename T> std::enable_if_t<_is_pair<T>, void>
+      extract_arg_value(T &value){
+        extract_arg_value(value.first);
+        extract_arg_value(value.second);
+      }
+      template <typename T> std::enable_if_t<_is_tuple<T>, void>
+      extract_arg_value(T &value){
+        extract(value);
+      }
+      // Not part of the message, the chunks arrive in messages of their own
+      void extract_arg_value(chunk_range &value){
+        if(!chunks) msg_strm.setstate(std::ios::failbit);
+        value.channel = chunks;
+      }
+      // Element count of a vector or map. Every element takes at least a byte, so a
+      // count bigger than what's left of the message is rejected before reserving.
+      std::uint64_t extract_count(){
+        std::uint64_t count = 0;
+        if(format == wire_format::binary) count = extract_varint();
+        else extract_number(count);
+        if(count > view_buf.remaining().size()) msg_strm.setstate(std::ios::failbit);
+        return count;
+      }
+      // Points into the message, so the message has to outlive value
+      void extract_arg_value(std::string_view &value){
+        if(format == wire_format::binary){
+          auto len = extract_varint();
+          if(msg_strm.fail()) return;
+          if(len > view_buf.remaining().size()){
+            msg_strm.setstate(std::ios::failbit);
+            return;
+          }
+          value = view_buf.remaining().substr(0, len);
+          view_buf.advance(len);
+          return;
+        }
+
+        msg_strm >> std::ws;
+        auto rest = view_buf.remaining();
+        if(rest.empty()){
+          msg_strm.setstate(std::ios::failbit);
+        }else if(rest[0] != '"'){
+          value = rest.substr(0, rest.find_first_of(" \t\n\v\f\r"));
+          view_buf.advance(value.size());
+        }else if(auto special = _find_quote_or_escape(rest.data() + 1, rest.data() + rest.size());
+                 special != rest.data() + rest.size() && *special == '"'){
+          value = rest.substr(1, special - rest.data() - 1);
+          view_buf.advance(value.size() + 2);
+        }else{
+          extract_quoted(unquoted.emplace_front());
+          value = unquoted.front();
+        }
       }
       template <typename T> std::enable_if_t<_is_tuple<T>, void>
       extract(T &value){
         extract_args_tuple(value, std::make_index_sequence<std::tuple_size_v<T>>{});
       }
-      from_serial(string msg_str){
-        msg_strm = std::stringstream(msg_str);
-        msg_strm >> prefix_str;
+      bool has_conv_failed(){return msg_strm.fail() || (msg_strm.rdbuf()->in_avail() != 0); }
+      // True when there is nothing but whitespace left to extract
+      bool at_end(){
+        if(format == wire_format::text) msg_strm >> std::ws;
+        return view_buf.remaining().empty();
+      }
+
+      std::uint64_t extract_varint(){
+        std::uint64_t value = 0;
+        for(unsigned shift = 0; shift < 64; shift += 7){
+          auto byte = msg_strm.get();
+          if(byte == std::char_traits<char>::eof()) break;
+          value |= std::uint64_t(byte & 0x7f) << shift;
+          if((byte & 0x80) == 0) return value;
+        }
+        msg_strm.setstate(std::ios::failbit);
+        return 0;
+      }
+      // msg_strm >> value for numbers, but locale-independent and without the num_get
+      // facet. Like the stream, a leading '+' is accepted and parsing stops at the first
+      // character that can't be part of the number.
+      template <typename T>
+      void extract_number(T &value){
+        msg_strm >> std::ws;
+        auto rest = view_buf.remaining();
+        char const *begin = rest.data(), *end = rest.data() + rest.size();
+        if(begin != end && *begin == '+') ++begin;
+        auto [ptr, ec] = std::from_chars(begin, end, value);
+        if(ec != std::errc()){
+          msg_strm.setstate(std::ios::failbit);
+          return;
+        }
+        view_buf.advance(ptr - rest.data());
+      }
+      // msg_strm >> std::quoted(value), appending clean runs in bulk instead of
+      // extracting one character at a time
+      void extract_quoted(string &value){
+        msg_strm >> std::ws;
+        auto rest = view_buf.remaining();
+        if(rest.empty()){
+          msg_strm.setstate(std::ios::failbit);
+          return;
+        }
+        if(rest[0] != '"'){
+          msg_strm >> value;
+          return;
+        }
+        value.clear();
+        char const *run = rest.data() + 1, *end = rest.data() + rest.size();
+        while(true){
+          char const *special = _find_quote_or_escape(run, end);
+          value.append(run, special - run);
+          if(special == end || (*special == '\\' && special + 1 == end)){
+            view_buf.advance(rest.size());
+            msg_strm.setstate(std::ios::eofbit | std::ios::failbit);
+            return;
+          }
+          if(*special == '"'){
+            view_buf.advance(special + 1 - rest.data());
+            return;
+          }
+          value += special[1];
+          run = special + 2;
+        }
+      }
+      void extract_binary(string &value){
+        std::string_view view;
+        extract_arg_value(view);
+        if(!msg_strm.fail()) value = view;
+      }
+      template <typename T> std::enable_if_t<_is_fixed_width<T>, void>
+      extract_binary(T &value){
+        using uint_t = typename _uint_of_size<sizeof(T)>::type;
+        unsigned char bytes[sizeof(T)];
+        if(!msg_strm.read(reinterpret_cast<char*>(bytes), sizeof(T))) return;
+        uint_t bits = 0;
+        for(std::size_t i = 0; i < sizeof(T); i++) bits |= uint_t(bytes[i]) << (8 * i);
+        if constexpr (std::is_same_v<T, bool>) value = bits != 0;
+        else std::memcpy(&value, &bits, sizeof(T));
+      }
+      template <typename T> std::enable_if_t<!_is_fixed_width<T>, void>
+      extract_binary(T &value){
+        string text;
+        extract_binary(text);
+        if(msg_strm.fail()) return;
+        std::istringstream text_strm(text);
+        text_strm >> value;
+        if(text_strm.fail() || text_strm.rdbuf()->in_avail() != 0) msg_strm.setstate(std::ios::failbit);
+      }
+
+    public:
+      // Doesn't copy msg, which has to outlive this and any string_view extracted from it
+      from_serial(std::string_view msg, wire_format _format = wire_format::text) : view_buf(msg), msg_strm(&view_buf){
+        format = _format;
+        if(format == wire_format::binary){
+          extract_binary(prefix_str);
+          if(prefix_str == "@"){
+            auto num = extract_varint();
+            if(!msg_strm.fail()) corr_id = num;
+            extract_binary(prefix_str);
+          }
+          if(prefix_str.empty() && !msg_strm.fail()){
+            auto num = extract_varint();
+            if(!msg_strm.fail() && num <= std::numeric_limits<fun_num_t>::max()) prefix_num = fun_num_t(num);
+          }
+        }else{
+          msg_strm >> prefix_str;
+          corr_id_t num;
+          if(prefix_str.size() > 1 && prefix_str[0] == '@' && _parse_num(std::string_view(prefix_str).substr(1), num)){
+            corr_id = num;
+            msg_strm >> prefix_str;
+          }
+          fun_num_t fun_num;
+          if(prefix_str.size() > 1 && prefix_str[0] == '#' && _parse_num(std::string_view(prefix_str).substr(1), fun_num)){
+            prefix_num = fun_num;
+          }
+        }
       }
   };
   class to_serial : public serial_message{
     protected:
       friend class invoker;
       friend class caller;
-      template <typename T>
-      std::enable_if_t<std::is_same_v<std::decay_t<T>, std::string>, void>
-      reinit(T const &value){
-        msg_strm << std::quoted(value);
+      friend class async_caller;
+      template <auto ... FUNS> friend class static_invoker;
+      serial_buffer &out;
+      std::ostream msg_strm;
+      // Where a returned chunk_source's chunks are sent, if the transport can take more
+      // than one message per call
+      transport_send_f const *chunk_send = nullptr;
+      // Where the message continues after the correlation ID tag
+      std::size_t body_start = 0;
+      // Of the last reinit, which is always passed a string literal
+      std::string_view status;
+
+      void reinit(std::string_view _status){
+        out.reset();
+        msg_strm.clear();
+        prefix_num.reset();
+        status = _status;
+        insert_prefix(status);
       }
-      template <typename T>
-      std::enable_if_t<!std::is_same_v<std::decay_t<T>, std::string>, void>
-      reinit(T const &value){
-        msg_strm << value;
+      // Replaces the message with the corr_id tag followed by a body saved from body()
+      void reinit_body(std::string_view saved_body){
+        out.reset();
+        msg_strm.clear();
+        insert_corr_id();
+        msg_strm.write(saved_body.data(), saved_body.size());
+        status = "PRPC_GOOD";
       }
+      std::string_view body() const {return out.view().substr(body_start); }
       template <typename T>
-      std::enable_if_t<std::is_same_v<std::decay_t<T>, std::string>, void>
+      std::enable_if_t<_is_string_like<T> || _is_composite<T>, void>
       append(T const &value){
-        msg_strm << ' ' << std::quoted(value);
+        insert_value(value);
       }
       template <typename T>
-      std::enable_if_t<!std::is_same_v<std::decay_t<T>, std::string>, void>
+      std::enable_if_t<!_is_string_like<T> && !_is_composite<T>, void>
       append(T const &value){
-        msg_strm << ' ' << value;
+        if(format == wire_format::binary) insert_binary(value);
+        else if constexpr (_is_charconv<T>){
+          msg_strm.put(' ');
+          insert_number(value);
+        }
+        else msg_strm << ' ' << value;
       }
       template <typename T>
-      std::enable_if_t<!std::is_same_v<std::decay_t<T>, std::string>, void>
+      std::enable_if_t<!_is_string_like<T> && !_is_composite<T>, void>
       insert_value(T const &value){
-        msg_strm << ' ' << value;
+        if(format == wire_format::binary) insert_binary(value);
+        else if constexpr (_is_charconv<T>){
+          msg_strm.put(' ');
+          insert_number(value);
+        }
+        else msg_strm << ' ' << value;
+      }
+      template <typename T>
+      std::enable_if_t<_is_vector<T> || _is_array<T>, void>
+      insert_value(T const &value){
+        using elem_t = typename T::value_type;
+        if constexpr (_is_vector<T>) insert_count(value.size());
+        if constexpr (_is_bulk<elem_t>){
+          if(format == wire_format::binary){
+            msg_strm.write(reinterpret_cast<char const*>(value.data()), value.size() * sizeof(elem_t));
+            return;
+          }
+        }
+        for(auto const &elem : value) insert_value(elem);
+      }
+      template <typename T>
+      std::enable_if_t<_is_map<T>, void>
+      insert_value(T const &value){
+        insert_count(value.size());
+        for(auto const &[key, mapped] : value){
+          insert_value(key);
+          insert_value(mapped);
+        }
+      }
+      template <typename T>
+      std::enable_if_t<_is_optional<T>, void>
+      insert_value(T const &value){
+        insert_value(value.has_value());
+        if(value) insert_value(*value);
+      }
+      template <typename T>
+      std::enable_if_t<_is_pair<T>, void>
+      insert_value(T const &value){
+        insert_value(value.first);
+        insert_value(value.second);
+      }
+      template <typename T>
+      std::enable_if_t<_is_tuple<T>, void>
+      insert_value(T const &value){
+        insert(value);
+      }
+      void insert_count(std::size_t count){
+        if(format == wire_format::binary) insert_varint(count);
+        else{
+          msg_strm.put(' ');
+          insert_number(count);
+        }
+      }
+      // Shortest text that parses back to the same value (exact for floating point) and
+      // the same in every locale
+      template <typename T>
+      void insert_number(T value){
+        char buf[64];
+        auto [end, ec] = std::to_chars(buf, buf + sizeof(buf), value);
+        msg_strm.write(buf, end - buf);
       }
       template <typename ... T, std::size_t ... I>
       void insert_tuple(std::tuple<T ... > const &tuple, std::index_sequence<I ... >){
         (insert_value(std::get<I>(tuple)) , ... );
       }
-      void insert_value(char const *value){insert_value(std::string{value});}
+      void insert_value(char const *value){insert_value(std::string_view{value});}
+      // Sends each chunk as a "PRPC_CHUNK" message tagged with corr_id ahead of the message
+      // being built. Without chunk_send the chunks are joined into one string instead.
+      void insert_value(chunk_source const &value){
+        string chunk;
+        if(chunk_send == nullptr){
+          string joined;
+          while(value(chunk)) joined += chunk;
+          insert_value(joined);
+          return;
+        }
+        serial_buffer chunk_buf;
+        while(value(chunk)){
+          to_serial chunk_msg(chunk_buf, "PRPC_CHUNK", format, corr_id);
+          chunk_msg.insert_value(chunk);
+          (*chunk_send)(string(chunk_buf.view()));
+        }
+      }
+      void append(chunk_source const &value){ insert_value(value); }
       template <typename T>
-      std::enable_if_t<std::is_same_v<std::decay_t<T>, std::string>, void>
+      std::enable_if_t<_is_string_like<T>, void>
       insert_value(T const &value){
-        msg_strm << ' ' << std::quoted(value);
+        if(format == wire_format::binary) insert_binary(value);
+        else{
+          msg_strm.put(' ');
+          _insert_quoted(msg_strm, value);
+        }
       }
       template <typename T>
       std::enable_if_t<_is_tuple<T>, void>
       insert(T const &value){
         insert_tuple(value, std::make_index_sequence<std::tuple_size_v<T>>{});
       }
-      to_serial(string _prefix_str){
-        msg_strm = std::stringstream();
-        prefix_str = std::move(_prefix_str);
-        msg_strm << prefix_str;
+
+      void insert_varint(std::uint64_t value){
+        while(value >= 0x80){
+          msg_strm.put(char((value & 0x7f) | 0x80));
+          value >>= 7;
+        }
+        msg_strm.put(char(value));
+      }
+      void insert_binary(std::string_view value){
+        insert_varint(value.size());
+        msg_strm.write(value.data(), value.size());
+      }
+      void insert_binary(char const *value){insert_binary(std::string_view{value});}
+      template <typename T> std::enable_if_t<_is_fixed_width<T>, void>
+      insert_binary(T const &value){
+        using uint_t = typename _uint_of_size<sizeof(T)>::type;
+        uint_t bits;
+        if constexpr (std::is_same_v<T, bool>) bits = value ? 1 : 0;
+        else std::memcpy(&bits, &value, sizeof(T));
+        char bytes[sizeof(T)];
+        for(std::size_t i = 0; i < sizeof(T); i++) bytes[i] = char(bits >> (8 * i));
+        msg_strm.write(bytes, sizeof(T));
+      }
+      template <typename T>
+      std::enable_if_t<!_is_fixed_width<T> && !_is_string_like<T>, void>
+      insert_binary(T const &value){
+        std::ostringstream text_strm;
+        text_strm << value;
+        insert_binary(text_strm.str());
+      }
+      void insert_corr_id(){
+        if(corr_id){
+          if(format == wire_format::binary){
+            insert_binary("@");
+            insert_varint(*corr_id);
+          }
+          else{
+            msg_strm.put('@');
+            insert_number(*corr_id);
+            msg_strm.put(' ');
+          }
+        }
+        body_start = out.size();
+      }
+      void insert_prefix(std::string_view prefix_str){
+        insert_corr_id();
+        if(format == wire_format::binary){
+          insert_binary(prefix_str);
+          if(prefix_num) insert_varint(*prefix_num);
+        }
+        else if(prefix_num){
+          msg_strm.put('#');
+          insert_number(*prefix_num);
+        }
+        else msg_strm.write(prefix_str.data(), prefix_str.size());
+      }
+
+      // Resets _out and writes the message into it
+      to_serial(serial_buffer &_out, wire_format _format = wire_format::text) : out(_out), msg_strm(&_out){
+        out.reset();
+        format = _format;
+      }
+      to_serial(serial_buffer &_out, std::string_view _prefix_str, wire_format _format = wire_format::text,
+                std::optional<corr_id_t> _corr_id = {}) : to_serial(_out, _format){
+        corr_id = _corr_id;
+        insert_prefix(_prefix_str);
+      }
+      to_serial(serial_buffer &_out, fun_num_t _prefix_num, wire_format _format = wire_format::text,
+                std::optional<corr_id_t> _corr_id = {}) : to_serial(_out, _format){
+        corr_id = _corr_id;
+        prefix_num = _prefix_num;
+        insert_prefix({});
+      }
+  };
+  // Passed to invoker::add to cache a function's responses. Only for functions whose
+  // result depends on nothing but their args. A capacity of 0 turns the cache off.
+  struct cache_options{
+    std::size_t capacity = 0;
+    std::chrono::steady_clock::duration ttl = std::chrono::steady_clock::duration::max();
+  };
+  struct cache_stats{
+    std::uint64_t hits = 0;
+    std::uint64_t misses = 0;
+    std::size_t size = 0;
+  };
+  // LRU of one function's PRPC_GOOD responses, without their correlation ID tag, keyed
+  // on the raw bytes of the call's args
+  class _response_cache{
+    using clock = std::chrono::steady_clock;
+    struct entry_t{
+      string args;
+      string response;
+      clock::time_point expires;
+    };
+    cache_options options;
+    std::mutex mutex;
+    // Most recently used first
+    std::list<entry_t> entries;
+    std::unordered_map<std::string_view, std::list<entry_t>::iterator> index;
+    cache_stats stats;
+    public:
+      _response_cache(cache_options _options) : options(_options) {}
+      // Calls on_hit with the cached response if there is a fresh one
+      template <typename FUN_T>
+      bool find(std::string_view args, FUN_T &&on_hit){
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = index.find(args);
+        if(it != index.end() && it->second->expires <= clock::now()){
+          entries.erase(it->second);
+          index.erase(it);
+          it = index.end();
+        }
+        if(it == index.end()){
+          stats.misses++;
+          return false;
+        }
+        stats.hits++;
+        entries.splice(entries.begin(), entries, it->second);
+        on_hit(std::string_view(it->second->response));
+        return true;
+      }
+      void insert(std::string_view args, std::string_view response){
+        auto expires = options.ttl == clock::duration::max() ? clock::time_point::max() : clock::now() + options.ttl;
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = index.find(args);
+        if(it != index.end()){
+          it->second->response = response;
+          it->second->expires = expires;
+          entries.splice(entries.begin(), entries, it->second);
+          return;
+        }
+        entries.push_front({string(args), string(response), expires});
+        index.emplace(entries.front().args, entries.begin());
+        if(entries.size() > options.capacity){
+          index.erase(entries.back().args);
+          entries.pop_back();
+        }
+      }
+      void clear(){
+        std::lock_guard<std::mutex> lock(mutex);
+        index.clear();
+        entries.clear();
+      }
+      cache_stats get_stats(){
+        std::lock_guard<std::mutex> lock(mutex);
+        cache_stats current = stats;
+        current.size = entries.size();
+        return current;
+      }
+  };
+  // Snapshot of one function's counters, from invoker::get_stats
+  struct function_stats{
+    // Latency histogram buckets: exact below 8ns, then 8 per power of two, so a bucket's
+    // values are within 12.5% of each other
+    static constexpr unsigned sub_bucket_bits = 3;
+    static constexpr std::size_t sub_buckets = std::size_t(1) << sub_bucket_bits;
+    static constexpr std::size_t buckets = (64 - sub_bucket_bits + 1) * sub_buckets;
+
+    std::uint64_t calls = 0;
+    // Failed calls by status, e.g. "PRPC_INV_EXCEPT"
+    std::map<string, std::uint64_t> errors;
+    std::uint64_t bytes_in = 0;
+    std::uint64_t bytes_out = 0;
+    std::uint64_t max_latency_ns = 0;
+    std::vector<std::uint64_t> latency_counts = std::vector<std::uint64_t>(buckets);
+
+    static std::size_t bucket_of(std::uint64_t ns){
+      if(ns < sub_buckets) return ns;
+      unsigned msb = 63 - __builtin_clzll(ns);
+      return (msb - sub_bucket_bits + 1) * sub_buckets + ((ns >> (msb - sub_bucket_bits)) & (sub_buckets - 1));
+    }
+    // Largest value that falls into bucket
+    static std::uint64_t bucket_max(std::size_t bucket){
+      if(bucket < sub_buckets) return bucket;
+      unsigned shift = bucket / sub_buckets - 1;
+      std::uint64_t lowest = std::uint64_t(sub_buckets + bucket % sub_buckets) << shift;
+      return lowest + ((std::uint64_t(1) << shift) - 1);
+    }
+    // Latency that the fraction q (e.g. 0.99) of calls took at most, within 12.5%
+    std::uint64_t latency_percentile(double q) const {
+      std::uint64_t total = 0;
+      for(auto count : latency_counts) total += count;
+      if(total == 0) return 0;
+      auto target = std::max<std::uint64_t>(1, std::uint64_t(q * double(total) + 0.999999));
+      std::uint64_t seen = 0;
+      for(std::size_t bucket = 0; bucket < latency_counts.size(); bucket++){
+        seen += latency_counts[bucket];
+        if(seen >= target) return std::min(bucket_max(bucket), max_latency_ns);
+      }
+      return max_latency_ns;
+    }
+  };
+  // One row of prpc-get-stats: function ID, calls, PRPC_INV_ARG_EXTRACT_FAILED and
+  // PRPC_INV_EXCEPT counts, bytes in and out, and p50, p99 and max latency in ns
+  using stats_row = std::tuple<string, std::uint64_t, std::uint64_t, std::uint64_t, std::uint64_t,
+                               std::uint64_t, std::uint64_t, std::uint64_t, std::uint64_t>;
+  // One row of prpc-list-functions: function ID, argspec and numeric ID
+  using function_row = std::tuple<string, string, fun_num_t>;
+  // Live counters of one function. Relaxed atomics, so recording never takes a lock and
+  // calls on different threads don't wait for each other.
+  class _fun_metrics{
+    std::atomic<std::uint64_t> calls{0};
+    std::atomic<std::uint64_t> arg_extract_failed{0};
+    std::atomic<std::uint64_t> exceptions{0};
+    std::atomic<std::uint64_t> bytes_in{0};
+    std::atomic<std::uint64_t> bytes_out{0};
+    std::atomic<std::uint64_t> max_latency_ns{0};
+    std::array<std::atomic<std::uint64_t>, function_stats::buckets> latency_counts{};
+    public:
+      void record(std::string_view status, std::size_t in, std::size_t out, std::uint64_t ns){
+        constexpr auto relaxed = std::memory_order_relaxed;
+        calls.fetch_add(1, relaxed);
+        if(status == "PRPC_INV_ARG_EXTRACT_FAILED") arg_extract_failed.fetch_add(1, relaxed);
+        else if(status == "PRPC_INV_EXCEPT") exceptions.fetch_add(1, relaxed);
+        bytes_in.fetch_add(in, relaxed);
+        bytes_out.fetch_add(out, relaxed);
+        latency_counts[function_stats::bucket_of(ns)].fetch_add(1, relaxed);
+        auto max = max_latency_ns.load(relaxed);
+        while(ns > max && !max_latency_ns.compare_exchange_weak(max, ns, relaxed));
+      }
+      function_stats snapshot() const {
+        constexpr auto relaxed = std::memory_order_relaxed;
+        function_stats stats;
+        stats.calls = calls.load(relaxed);
+        if(auto count = arg_extract_failed.load(relaxed)) stats.errors["PRPC_INV_ARG_EXTRACT_FAILED"] = count;
+        if(auto count = exceptions.load(relaxed)) stats.errors["PRPC_INV_EXCEPT"] = count;
+        stats.bytes_in = bytes_in.load(relaxed);
+        stats.bytes_out = bytes_out.load(relaxed);
+        stats.max_latency_ns = max_latency_ns.load(relaxed);
+        for(std::size_t bucket = 0; bucket < latency_counts.size(); bucket++)
+          stats.latency_counts[bucket] = latency_counts[bucket].load(relaxed);
+        return stats;
       }
-      to_serial(){}
   };
   class invoker{
+    friend class pool_invoker;
+    friend class queue_invoker;
     template <typename> struct function_signature;
     template <typename R, typename ... T> struct function_signature<std::function<R(T ... )>>{
       using ret_t = std::decay_t<R>;
       using args_tupl_t = std::tuple<std::decay_t<T> ... >;
+      // Returns a task, runs as a coroutine
+      static constexpr bool coroutine = _is_task<ret_t>;
     };
     template <typename FUN_T, typename ARGS_T>
     static std::enable_if_t<!std::is_same_v<std::decay_t<decltype(std::apply(std::declval<FUN_T>(), std::declval<ARGS_T>()))>, void>, void>
@@ -168,155 +1202,1375 @@ namespace prpc{
       std::apply(std::move(func), std::move(args));
       resp.reinit("PRPC_GOOD");
     }
-    map<string, function<void(from_serial&,to_serial&)>> wrapped_functions;
+    // A registered function. Shared by the registry and by the calls running it, so remove
+    // doesn't pull it out from under a call.
+    struct registered_t : std::enable_shared_from_this<registered_t>{
+      string fun_id;
+      fun_num_t fun_num = 0;
+      string argspec;
+      function<void(from_serial&,to_serial&)> wrapped;
+      // Has a chunk_range parameter
+      bool chunked = false;
+      // Null unless added with a cache_options
+      std::unique_ptr<_response_cache> cache;
+      _fun_metrics metrics;
+#if PRPC_HAS_COROUTINES
+      // Set for a function returning a task
+      function<task<>(from_serial&,to_serial&)> coro_wrapped;
+#endif
+    };
+    // The tables lookups find functions in. add fills a free entry in place, and only
+    // replaces the table with one twice the size once it runs out, so adding n functions
+    // costs O(n) in all.
+    class lookup_table_t{
+      using entry_t = std::atomic<registered_t*>;
+      // By numeric ID, null if not added yet or removed. Numeric IDs aren't reused.
+      std::size_t num_capacity;
+      std::unique_ptr<entry_t[]> by_num;
+      // By function ID, open addressing with linear probing. A removed function leaves a
+      // tombstone, so probes for the functions after it still find them.
+      std::size_t id_mask;
+      std::unique_ptr<entry_t[]> by_id;
+      // Entries of by_id that aren't null, tombstones included
+      std::size_t id_used = 0;
+
+      static registered_t *tombstone(){
+        static registered_t removed;
+        return &removed;
+      }
+      std::size_t first_slot(std::string_view fun_id) const {return std::hash<std::string_view>{}(fun_id) & id_mask; }
+      public:
+        // id_capacity is a power of 2
+        lookup_table_t(std::size_t _num_capacity, std::size_t id_capacity) : num_capacity(_num_capacity),
+          by_num(new entry_t[_num_capacity]), id_mask(id_capacity - 1), by_id(new entry_t[id_capacity]) {
+          for(std::size_t i = 0; i < num_capacity; i++) by_num[i].store(nullptr, std::memory_order_relaxed);
+          for(std::size_t i = 0; i <= id_mask; i++) by_id[i].store(nullptr, std::memory_order_relaxed);
+        }
+        registered_t *find(fun_num_t fun_num) const {
+          return fun_num < num_capacity ? by_num[fun_num].load(std::memory_order_acquire) : nullptr;
+        }
+        registered_t *find(std::string_view fun_id) const {
+          for(std::size_t i = first_slot(fun_id); ; i = (i + 1) & id_mask){
+            registered_t *fun = by_id[i].load(std::memory_order_acquire);
+            if(!fun) return nullptr;
+            if(fun != tombstone() && fun->fun_id == fun_id) return fun;
+          }
+        }
+        // Whether insert has room for fun_num, keeping by_id at most half full
+        bool fits(fun_num_t fun_num) const {return fun_num < num_capacity && 2 * (id_used + 1) <= id_mask + 1; }
+        // Only for the writer, for a function that isn't in the table
+        void insert(registered_t *fun){
+          std::size_t i = first_slot(fun->fun_id);
+          for(registered_t *entry; (entry = by_id[i].load(std::memory_order_relaxed)) && entry != tombstone();) i = (i + 1) & id_mask;
+          if(!by_id[i].load(std::memory_order_relaxed)) id_used++;
+          by_id[i].store(fun, std::memory_order_release);
+          by_num[fun->fun_num].store(fun, std::memory_order_release);
+        }
+        // Only for the writer, for a function that is in the table
+        void erase(registered_t *fun){
+          by_num[fun->fun_num].store(nullptr, std::memory_order_release);
+          std::size_t i = first_slot(fun->fun_id);
+          while(by_id[i].load(std::memory_order_relaxed) != fun) i = (i + 1) & id_mask;
+          by_id[i].store(tombstone(), std::memory_order_release);
+        }
+    };
+    // FNV-1a of a function's ID, argspec and numeric ID
+    static std::uint64_t row_hash(registered_t const &fun){
+      std::uint64_t hash = 0xcbf29ce484222325;
+      auto mix = [&hash](std::string_view bytes){
+        for(unsigned char c : bytes) hash = (hash ^ c) * 0x100000001b3;
+      };
+      mix(fun.fun_id);
+      mix(std::string_view("", 1));
+      mix(fun.argspec);
+      mix(std::string_view("", 1));
+      mix(std::to_string(fun.fun_num));
+      return hash;
+    }
+    // Lookups take no lock. Each counts itself in one of two counters of its thread's
+    // stripe, so lookups on threads with different stripes don't write the same cache
+    // line. A writer about to free something a lookup may still see moves new lookups to
+    // the other counters, then waits for the old ones to drain. A lookup that reaches an
+    // old counter after the move sees the new epoch and leaves it again, so the writer
+    // only waits for lookups that were already running.
+    // Lookups only find a function, so a writer waits for lookups, never for calls.
+    static constexpr std::size_t reader_stripes = 16;
+    struct alignas(64) reader_stripe{
+      std::atomic<std::size_t> counts[2]{};
+    };
+    static std::size_t this_thread_stripe(){
+      static std::atomic<std::size_t> next_stripe{0};
+      thread_local std::size_t stripe = next_stripe.fetch_add(1, std::memory_order_relaxed) % reader_stripes;
+      return stripe;
+    }
+    class registry_reader{
+      std::atomic<std::size_t> *count;
+      public:
+        lookup_table_t const *table;
+        registry_reader(invoker &inv){
+          auto &stripe = inv.registry_readers[this_thread_stripe()];
+          while(true){
+            auto epoch = inv.registry_epoch.load();
+            count = &stripe.counts[epoch & 1];
+            count->fetch_add(1);
+            if(inv.registry_epoch.load() == epoch) break;
+            count->fetch_sub(1);
+          }
+          table = inv.lookup.load();
+        }
+        registry_reader(registry_reader const &) = delete;
+        ~registry_reader(){ count->fetch_sub(1); }
+    };
+    std::atomic<lookup_table_t*> lookup{nullptr};
+    std::atomic<std::uint64_t> registry_epoch{0};
+    reader_stripe registry_readers[reader_stripes];
+    // Held by add and remove, which are the only writers, and by what lists every function
+    std::mutex registry_write_mutex;
+    std::unique_ptr<lookup_table_t> lookup_owner;
+    map<string, std::shared_ptr<registered_t>> by_id;
+    fun_num_t next_fun_num = 0;
+    // Sum of the row_hash of every function, so add and remove update it in O(1)
+    std::uint64_t table_hash = 0;
+
+    std::atomic<std::uint64_t> unknown_calls{0};
+    fun_num_t batch_fun_num = 0;
     transport_sendrec_f rec_fun;
     transport_send_f send_fun;
-    map<string, string> func_argstr;
+    wire_format format;
+    serial_buffer response_buf;
+    // Serializes send_fun between invoke and the threads of streamed calls
+    std::mutex send_mutex;
+    transport_send_f locked_send_fun = [this](string message){
+      std::lock_guard<std::mutex> lock(send_mutex);
+      send_fun(std::move(message));
+    };
+    // Streamed calls by the reply function of their connection and correlation ID, until
+    // their "prpc-chunk-end" message arrives
+    std::mutex streams_mutex;
+    map<std::pair<transport_send_f const*, corr_id_t>, std::shared_ptr<_chunk_channel>> open_streams;
+    std::vector<std::pair<std::thread, std::shared_ptr<_chunk_channel>>> stream_threads;
 
-    map<string, string>::iterator funiter=func_argstr.begin();
+    static bool is_builtin(string const &fun_id){
+      return fun_id == "prpc-get-next-function" || fun_id == "prpc-list-functions" || fun_id == "prpc-get-version" ||
+             fun_id == "prpc-batch" || fun_id == "prpc-get-stats";
+    }
+    // Every function but the builtins, or none if known_hash is already the table's hash
+    std::pair<std::uint64_t, std::vector<function_row>> list_functions(std::uint64_t known_hash){
+      std::lock_guard<std::mutex> lock(registry_write_mutex);
+      std::pair<std::uint64_t, std::vector<function_row>> table{table_hash, {}};
+      if(known_hash == table.first) return table;
+      table.second.reserve(by_id.size());
+      for(auto &[fun_id, fun] : by_id){
+        if(!is_builtin(fun_id)) table.second.emplace_back(fun_id, fun->argspec, fun->fun_num);
+      }
+      return table;
+    }
+    // The last function ID prpc-get-next-function listed, shared by everyone listing.
+    // prpc-list-functions has no cursor.
+    string funiter_last;
     string next_func(){
-       if(funiter == func_argstr.end()){
-        funiter=func_argstr.begin();
-        funiter++;
+      std::lock_guard<std::mutex> lock(registry_write_mutex);
+      auto funiter = by_id.upper_bound(funiter_last);
+      while(funiter != by_id.end() && is_builtin(funiter->first)) funiter++;
+      if(funiter == by_id.end()){
+        funiter_last.clear();
         return string{"PRPC_FUNLIST_END"};
       }
-       if (funiter->first == "prpc-get-next-function" || funiter->first == "prpc-get-version") {
-        funiter++;
-        return next_func();
-      }
-
-      string rv = "\"" + funiter->first + " " + funiter->second + "\"";
-      funiter++;
-      return rv;
+      funiter_last = funiter->first;
+      return "\"" + funiter->first + " " + funiter->second->argspec + " #" + std::to_string(funiter->second->fun_num) + "\"";
     }
     string return_version(){
       return string(PRPC_VERSION_STR);
     }
+    std::vector<stats_row> return_stats(){
+      std::vector<stats_row> rows;
+      for(auto &[fun_id, stats] : get_stats()){
+        auto errors = [&stats = stats](char const *status){
+          auto it = stats.errors.find(status);
+          return it == stats.errors.end() ? std::uint64_t(0) : it->second;
+        };
+        rows.emplace_back(fun_id, stats.calls, errors("PRPC_INV_ARG_EXTRACT_FAILED"), errors("PRPC_INV_EXCEPT"),
+                          stats.bytes_in, stats.bytes_out, stats.latency_percentile(0.5),
+                          stats.latency_percentile(0.99), stats.max_latency_ns);
+      }
+      return rows;
+    }
+    // Args are complete invocation messages, each sent as a string. The response has
+    // one string per message, holding that message's complete response. A batch in a
+    // batch gets PRPC_INV_ARG_EXTRACT_FAILED, so nesting can't recurse without limit.
+    void invoke_batch(from_serial &inv_params, to_serial &resp){
+      serial_buffer entry_response;
+      resp.reinit("PRPC_GOOD");
+      while(!inv_params.at_end()){
+        std::string_view entry;
+        inv_params.extract_arg_value(entry);
+        if(inv_params.msg_strm.fail()){
+          resp.reinit("PRPC_INV_ARG_EXTRACT_FAILED");
+          return;
+        }
+        from_serial entry_params(entry, format);
+        auto fun = find_fun(entry_params);
+        if(fun && fun->fun_num == batch_fun_num){
+          to_serial rejected(entry_response, format);
+          rejected.corr_id = entry_params.corr_id;
+          rejected.reinit("PRPC_INV_ARG_EXTRACT_FAILED");
+        }else{
+          invoke_parsed(entry_params, fun, entry_response);
+        }
+        resp.append(entry_response.view());
+      }
+    }
+    // Called with registry_write_mutex held. Returns once no lookup can still see what was
+    // removed from or replaced in the registry before.
+    void wait_for_readers(){
+      auto epoch = registry_epoch.fetch_add(1);
+      for(auto &stripe : registry_readers){
+        while(stripe.counts[epoch & 1].load() != 0) std::this_thread::yield();
+      }
+    }
+    // Called with registry_write_mutex held. Replaces the lookup table with one that has
+    // room for as many functions again.
+    void grow_lookup(){
+      std::size_t id_capacity = 16;
+      while(id_capacity < 4 * by_id.size()) id_capacity *= 2;
+      auto next = std::make_unique<lookup_table_t>(std::max<std::size_t>(16, 2 * std::size_t(next_fun_num)), id_capacity);
+      for(auto &entry : by_id) next->insert(entry.second.get());
+      lookup.store(next.get());
+      wait_for_readers();
+      lookup_owner = std::move(next);
+    }
+    fun_num_t add_wrapped(string fun_id, string argspec, function<void(from_serial&,to_serial&)> fun_wrap, bool chunked = false,
+                          cache_options cache = {}){
+      auto fun = std::make_shared<registered_t>();
+      fun->argspec = std::move(argspec);
+      fun->wrapped = std::move(fun_wrap);
+      fun->chunked = chunked;
+      if(cache.capacity != 0) fun->cache.reset(new _response_cache(cache));
+      return add_registered(std::move(fun_id), std::move(fun));
+    }
+    fun_num_t add_registered(string fun_id, std::shared_ptr<registered_t> fun){
+      std::lock_guard<std::mutex> lock(registry_write_mutex);
+      if(fun_id.empty() || fun_id[0] == '#' || fun_id[0] == '@' || by_id.count(fun_id) != 0) throw std::exception();
+
+      fun->fun_id = fun_id;
+      fun->fun_num = next_fun_num++;
+      by_id.emplace(std::move(fun_id), fun);
+      table_hash += row_hash(*fun);
+      if(lookup_owner->fits(fun->fun_num)) lookup_owner->insert(fun.get());
+      else grow_lookup();
+      return fun->fun_num;
+    }
+#if PRPC_HAS_COROUTINES
+    template<typename FUN_T>
+    fun_num_t add_coroutine(string fun_id, string argspec, FUN_T function, cache_options cache){
+      if(cache.capacity != 0) throw std::exception();
+      using function_signature = function_signature<decltype(std::function{function})>;
+      using args_tupl_t = typename function_signature::args_tupl_t;
+      using value_t = typename function_signature::ret_t::value_type;
+
+      auto fun = std::make_shared<registered_t>();
+      fun->argspec = std::move(argspec);
+      fun->wrapped = [](from_serial &, to_serial &){
+        throw std::runtime_error("coroutine functions are only called through invoke(string)");
+      };
+      // The args stay in this coroutine's frame, and the message they are read from in
+      // run_coroutine's, until the function's task finishes
+      fun->coro_wrapped = [_function = std::move(function)] (from_serial &inv_params, to_serial &resp) -> task<> {
+        args_tupl_t data;
+        inv_params.extract(data);
+        if(inv_params.has_conv_failed() == true){
+          resp.reinit("PRPC_INV_ARG_EXTRACT_FAILED");
+          co_return;
+        }
+        if constexpr (std::is_void_v<value_t>){
+          co_await std::apply(_function, std::move(data));
+          resp.reinit("PRPC_GOOD");
+        }else{
+          auto value = co_await std::apply(_function, std::move(data));
+          resp.reinit("PRPC_GOOD");
+          resp.append(value);
+        }
+      };
+      return add_registered(std::move(fun_id), std::move(fun));
+    }
+    // Runs a coroutine function up to its first suspension and returns. Whoever resumes it
+    // last sends the response through reply when it finishes.
+    _detached run_coroutine(string message, std::shared_ptr<registered_t> fun, transport_send_f reply){
+      serial_buffer response;
+      {
+        from_serial inv_params(message, format);
+        to_serial ret_param(response, format);
+        ret_param.corr_id = inv_params.corr_id;
+        auto start = std::chrono::steady_clock::now();
+        try{
+          co_await fun->coro_wrapped(inv_params, ret_param);
+        }catch(std::exception& e){
+          ret_param.reinit("PRPC_INV_EXCEPT");
+          ret_param.append(e.what());
+        }catch(...){
+          // Escaping would terminate, as nothing awaits this coroutine
+          ret_param.reinit("PRPC_INV_EXCEPT");
+          ret_param.append("unknown exception");
+        }
+        auto latency = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start);
+        fun->metrics.record(ret_param.status, inv_params.view_buf.size(), response.size(), latency.count());
+      }
+      try{
+        reply(string(response.view()));
+      }catch(...){
+        // As for streamed calls, there is nowhere to report a transport failure to
+      }
+    }
+#endif
+    std::shared_ptr<registered_t> find_fun(from_serial const &inv_params){
+      registry_reader reader(*this);
+      registered_t *fun = inv_params.prefix_num ? reader.table->find(*inv_params.prefix_num) : reader.table->find(inv_params.prefix_str);
+      return fun ? fun->shared_from_this() : nullptr;
+    }
+    void invoke_message(std::string_view message, serial_buffer &response){
+      from_serial inv_params(message, format);
+      invoke_parsed(inv_params, find_fun(inv_params), response);
+    }
+    void invoke_parsed(from_serial &inv_params, std::shared_ptr<registered_t> const &fun, serial_buffer &response,
+                       transport_send_f const *chunk_send = nullptr){
+      to_serial ret_param(response, format);
+      ret_param.corr_id = inv_params.corr_id;
+      ret_param.chunk_send = chunk_send;
+
+      if(!fun){
+        unknown_calls.fetch_add(1, std::memory_order_relaxed);
+        ret_param.reinit("PRPC_INV_FUN_NOEXIST");
+        return;
+      }
+      auto start = std::chrono::steady_clock::now();
+      _response_cache *cache = fun->cache.get();
+      std::string_view args = inv_params.view_buf.remaining();
+      if(!cache || !cache->find(args, [&ret_param](std::string_view body){ ret_param.reinit_body(body); })){
+        try{
+          fun->wrapped(inv_params, ret_param);
+          if(cache && ret_param.status == "PRPC_GOOD") cache->insert(args, ret_param.body());
+        }catch(std::exception& e){
+          ret_param.reinit("PRPC_INV_EXCEPT");
+          ret_param.append(e.what());
+        }
+      }
+      auto latency = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start);
+      fun->metrics.record(ret_param.status, inv_params.view_buf.size(), response.size(), latency.count());
+    }
+    // "prpc-chunk" and "prpc-chunk-end" messages of a streamed call. Blocks while the
+    // function is behind by a few chunks.
+    void receive_chunk(from_serial &chunk_msg, transport_send_f const &reply){
+      std::shared_ptr<_chunk_channel> channel;
+      bool last = chunk_msg.prefix_str == "prpc-chunk-end";
+      {
+        std::lock_guard<std::mutex> lock(streams_mutex);
+        auto it = open_streams.find({&reply, *chunk_msg.corr_id});
+        if(it == open_streams.end()) return;
+        channel = it->second;
+        if(last) open_streams.erase(it);
+      }
+      if(last){
+        channel->end();
+        return;
+      }
+      string chunk;
+      chunk_msg.extract_arg_value(chunk);
+      if(chunk_msg.msg_strm.fail()) channel->end();
+      else channel->push(std::move(chunk));
+    }
+    void start_stream(string message, corr_id_t corr_id, std::shared_ptr<registered_t> fun, transport_send_f const &reply){
+      auto channel = std::make_shared<_chunk_channel>();
+      std::lock_guard<std::mutex> lock(streams_mutex);
+      stream_threads.erase(std::remove_if(stream_threads.begin(), stream_threads.end(), [](auto &stream){
+        if(!stream.second->is_finished()) return false;
+        stream.first.join();
+        return true;
+      }), stream_threads.end());
+      stream_threads.reserve(stream_threads.size() + 1);
+
+      std::thread thread([this, message = std::move(message), channel, fun = std::move(fun), reply]{
+        serial_buffer response;
+        {
+          from_serial inv_params(message, format);
+          inv_params.chunks = channel;
+          invoke_parsed(inv_params, fun, response, &reply);
+        }
+        channel->finish();
+        try{
+          reply(string(response.view()));
+        }catch(...){
+          // Nowhere to report a transport failure from this thread, the response is dropped
+        }
+      });
+      auto &open = open_streams[{&reply, corr_id}];
+      if(open) open->end();
+      open = channel;
+      stream_threads.emplace_back(std::move(thread), std::move(channel));
+    }
+    void dispatch(string inv_param_str, serial_buffer &response, transport_send_f const &reply){
+      from_serial inv_params(inv_param_str, format);
+      if(inv_params.corr_id && (inv_params.prefix_str == "prpc-chunk" || inv_params.prefix_str == "prpc-chunk-end")){
+        receive_chunk(inv_params, reply);
+        return;
+      }
+      auto fun = find_fun(inv_params);
+#if PRPC_HAS_COROUTINES
+      if(fun && fun->coro_wrapped){
+        run_coroutine(std::move(inv_param_str), std::move(fun), reply);
+        return;
+      }
+#endif
+      if(inv_params.corr_id && fun && fun->chunked){
+        start_stream(std::move(inv_param_str), *inv_params.corr_id, std::move(fun), reply);
+        return;
+      }
+      // Chunks only make sense to a caller that matches them by correlation ID
+      invoke_parsed(inv_params, fun, response, inv_params.corr_id ? &reply : nullptr);
+      reply(string(response.view()));
+    }
+    void check_send_fun() const {
+      if(!send_fun) throw std::logic_error("prpc::invoker has no send_fun, pass a reply to invoke and send_invalidation");
+    }
     public:
-      invoker(transport_send_f _send_fun){
+      // send_fun can be empty if responses only go through the reply of invoke(message, reply).
+      // response_resource provides the storage of the response buffer reused by invoke
+      invoker(transport_send_f _send_fun, wire_format _format = wire_format::text,
+              std::pmr::memory_resource *response_resource = std::pmr::get_default_resource()) : response_buf(response_resource){
+        lookup_owner = std::make_unique<lookup_table_t>(16, 16);
+        lookup.store(lookup_owner.get());
         send_fun = std::move(_send_fun);
+        format = _format;
         add("prpc-get-next-function", "void|void", (std::function<string(void)>)std::bind(&invoker::next_func,this));
+        add("prpc-list-functions", "uint64|uint64 function_row...",
+            (std::function<std::pair<std::uint64_t, std::vector<function_row>>(std::uint64_t)>)std::bind(&invoker::list_functions, this, std::placeholders::_1));
         add("prpc-get-version", "void|void", (std::function<string(void)>)std::bind(&invoker::return_version,this));
+        add("prpc-get-stats", "void|stats_row...", (std::function<std::vector<stats_row>(void)>)std::bind(&invoker::return_stats,this));
+        batch_fun_num = add_wrapped("prpc-batch", "string...|string...", std::bind(&invoker::invoke_batch, this, std::placeholders::_1, std::placeholders::_2));
+      }
+      // Streamed calls that are still waiting for chunks see the end of their input
+      ~invoker(){
+        {
+          std::lock_guard<std::mutex> lock(streams_mutex);
+          for(auto &stream : open_streams) stream.second->end();
+        }
+        for(auto &stream : stream_threads) stream.first.join();
+      }
+      template<typename FUN_T>
+      fun_num_t add(string fun_id, FUN_T function){
+        return add(std::move(fun_id), string{}, std::move(function));
       }
       template<typename FUN_T>
-      void add(string fun_id, string argspec, FUN_T function){
-        if(wrapped_functions.count(fun_id) != 0) throw std::exception();
+      fun_num_t add(string fun_id, FUN_T function, cache_options cache){
+        return add(std::move(fun_id), string{}, std::move(function), cache);
+      }
+      // Returns the numeric ID that can be used in place of fun_id to call the function.
+      // With a cache, a call whose args are byte for byte the same as an earlier call's
+      // gets the earlier response without the function being called. Streamed functions
+      // can't be cached.
+      // A function returning a task<R> is a coroutine function, see invoke(string).
+      template<typename FUN_T>
+      fun_num_t add(string fun_id, string argspec, FUN_T function, cache_options cache = {}){
+        using fun_signature = function_signature<decltype(std::function{function})>;
+#if PRPC_HAS_COROUTINES
+        if constexpr (fun_signature::coroutine){
+          return add_coroutine(std::move(fun_id), std::move(argspec), std::move(function), cache);
+        }else
+#endif
+        {
+          auto fun_wrap = [_function = std::move(function)] (from_serial &inv_params, to_serial &resp){
+            std::function func{std::move(_function)};
 
-        auto fun_wrap = [_function = std::move(function)] (from_serial &inv_params, to_serial &resp){
-          std::function func{std::move(_function)};
+            using function_signature = function_signature<decltype(func)>;
+            using args_tupl_t = typename function_signature::args_tupl_t;
 
-          using function_signature = function_signature<decltype(func)>;
-          using args_tupl_t = typename function_signature::args_tupl_t;
+            args_tupl_t data;
+            inv_params.extract(data);
 
-          args_tupl_t data;
-          inv_params.extract(data);
+            if(inv_params.has_conv_failed() == true) resp.reinit("PRPC_INV_ARG_EXTRACT_FAILED");
+            else apply_optional_return(std::move(func), std::move(data), resp);
+          };
 
-          if(inv_params.has_conv_failed() == true) resp.reinit("PRPC_INV_ARG_EXTRACT_FAILED");
-          else apply_optional_return(std::move(func), std::move(data), resp);
-        };
+          constexpr bool streamed = _has_chunk_range<typename fun_signature::args_tupl_t> ||
+                                    std::is_same_v<typename fun_signature::ret_t, chunk_source>;
+          if(streamed && cache.capacity != 0) throw std::exception();
+          return add_wrapped(std::move(fun_id), std::move(argspec), std::move(fun_wrap),
+                             _has_chunk_range<typename fun_signature::args_tupl_t>, cache);
+        }
+      }
+      // Removes fun_id, returns false if there is no such function. Calls already running
+      // it finish normally. Its numeric ID isn't given to another function.
+      bool remove(string const &fun_id){
+        std::lock_guard<std::mutex> lock(registry_write_mutex);
+        auto it = by_id.find(fun_id);
+        if(it == by_id.end()) return false;
 
-        wrapped_functions[fun_id] = std::move(fun_wrap);
-        func_argstr[fun_id] = argspec;
-        funiter=func_argstr.begin();
-        funiter++;
+        lookup_owner->erase(it->second.get());
+        table_hash -= row_hash(*it->second);
+        // Lookups that found it have their own reference once they are done
+        wait_for_readers();
+        by_id.erase(it);
+        return true;
+      }
+      // Hits, misses and the number of cached responses of a function added with a cache
+      cache_stats get_cache_stats(string const &fun_id){
+        registry_reader reader(*this);
+        registered_t *fun = reader.table->find(fun_id);
+        if(!fun || !fun->cache) return {};
+        return fun->cache->get_stats();
+      }
+      // Drops the cached responses of fun_id, e.g. after the data it looks up has changed
+      void invalidate(string const &fun_id){
+        registry_reader reader(*this);
+        registered_t *fun = reader.table->find(fun_id);
+        if(fun && fun->cache) fun->cache->clear();
+      }
+      // Drops every cached response
+      void invalidate(){
+        std::lock_guard<std::mutex> lock(registry_write_mutex);
+        for(auto &fun : by_id) if(fun.second->cache) fun.second->cache->clear();
+      }
+      // Counters of every function, builtins included, by function ID. Also returned by the
+      // builtin prpc-get-stats as a vector of stats_row.
+      std::map<string, function_stats> get_stats(){
+        std::lock_guard<std::mutex> lock(registry_write_mutex);
+        std::map<string, function_stats> stats;
+        for(auto &fun : by_id) stats.emplace(fun.first, fun.second->metrics.snapshot());
+        return stats;
+      }
+      // Calls to function IDs that don't exist
+      std::uint64_t get_unknown_calls(){ return unknown_calls.load(std::memory_order_relaxed); }
+      // Sends a PRPC_INVALIDATE message through send_fun telling callers to drop their
+      // memoized results of fun_id, or of every function if fun_id is empty. Throws
+      // std::logic_error if the invoker has no send_fun.
+      void send_invalidation(string const &fun_id = {}){
+        check_send_fun();
+        send_invalidation(fun_id, locked_send_fun);
+      }
+      // The same through reply, e.g. once per connection of an invoker without send_fun
+      void send_invalidation(string const &fun_id, transport_send_f const &reply){
+        serial_buffer message;
+        to_serial params(message, "PRPC_INVALIDATE", format);
+        params.insert_value(fun_id);
+        reply(string(message.view()));
       }
 
+      // These two share the invoker's response buffer, so only one of them can run at a time.
+      // A call with a correlation ID to a function with a chunk_range parameter is streamed:
+      // it runs on a thread of its own, reading the chunks that the following "prpc-chunk"
+      // messages with the same correlation ID bring, until "prpc-chunk-end". Its response is
+      // sent when it returns. A returned chunk_source is sent as one message per chunk.
+      // A coroutine function runs on this thread until it first suspends, and its response
+      // is sent when its task finishes, from the thread that resumed it. Only this invoke
+      // and invoke(message, reply) run coroutine functions, the others respond with
+      // PRPC_INV_EXCEPT. The invoker has
+      // to outlive the coroutines still running. Throws std::logic_error if the invoker
+      // has no send_fun.
       void invoke(string inv_param_str){
-        from_serial inv_params(inv_param_str);
-        to_serial ret_param("");
+        check_send_fun();
+        dispatch(std::move(inv_param_str), response_buf, locked_send_fun);
+      }
+      // Reads message in place and writes the response into the caller's buffer instead of
+      // calling send_fun. With the binary format, string_view args and a response buffer with
+      // enough capacity this doesn't allocate. Not thread-safe: it goes through the invoker's
+      // own response buffer, unlike the serial_buffer overload below.
+      void invoke(std::string_view message, string &response){
+        invoke(message, response_buf);
+        response.assign(response_buf.data(), response_buf.size());
+      }
+      // Safe to call from several threads at once, each with its own response buffer, and
+      // while functions are added or removed. Looking the function up takes no lock.
+      void invoke(std::string_view message, serial_buffer &response){
+        invoke_message(message, response);
+      }
+      // The same as invoke(string), except that the response goes to reply instead of
+      // send_fun, so one invoker and its functions can serve every connection of a server:
+      // each message is passed with the send function of the connection it came from.
+      // Safe to call from several threads at once. A streamed call's chunk messages have to
+      // come with the same reply object, by address, as the call, and reply has to be safe
+      // to call from other threads if streamed or coroutine functions are used.
+      void invoke(string message, transport_send_f const &reply){
+        serial_buffer response;
+        dispatch(std::move(message), response, reply);
+      }
+  };
+  // Invoker that runs calls on a pool of worker threads, so a slow function doesn't hold
+  // up the transport or other calls. invoke queues the message and returns straight away,
+  // and the response, tagged with the request's correlation ID, is sent through send_fun
+  // from the worker thread. Calls to send_fun are serialized.
+  class pool_invoker : public invoker{
+    // Messages with a strand key run one at a time, in the order they were queued
+    struct job_t{
+      std::optional<std::uint64_t> strand;
+      string message;
+    };
+    std::mutex queue_mutex;
+    std::condition_variable queue_cv;
+    std::condition_variable idle_cv;
+    std::deque<job_t> queue;
+    // Strands with a job queued or running, and the messages waiting behind it
+    std::unordered_map<std::uint64_t, std::deque<string>> strands;
+    std::size_t running = 0;
+    bool stopping = false;
+    std::vector<std::thread> workers;
+
+    void work(){
+      serial_buffer response;
+      std::unique_lock<std::mutex> lock(queue_mutex);
+      while(true){
+        queue_cv.wait(lock, [this]{ return stopping || !queue.empty(); });
+        if(queue.empty()) return;
+        job_t job = std::move(queue.front());
+        queue.pop_front();
+        running++;
+        lock.unlock();
+
+        invoker::invoke(job.message, response);
+        try{
+          std::lock_guard<std::mutex> send_lock(send_mutex);
+          send_fun(string(response.view()));
+        }catch(...){
+          // Nowhere to report a transport failure from a worker, the response is dropped
+        }
 
-        if(wrapped_functions.count(inv_params.prefix_str) == 0){
+        lock.lock();
+        running--;
+        if(job.strand){
+          auto strand = strands.find(*job.strand);
+          if(strand->second.empty()){
+            strands.erase(strand);
+          }else{
+            queue.push_back({job.strand, std::move(strand->second.front())});
+            strand->second.pop_front();
+            queue_cv.notify_one();
+          }
+        }
+        if(running == 0 && queue.empty()) idle_cv.notify_all();
+      }
+    }
+    public:
+      pool_invoker(transport_send_f _send_fun, std::size_t threads = std::thread::hardware_concurrency(),
+                   wire_format _format = wire_format::text) : invoker(std::move(_send_fun), _format){
+        for(std::size_t i = 0; i < std::max<std::size_t>(threads, 1); i++) workers.emplace_back(&pool_invoker::work, this);
+      }
+      // Finishes the queued calls before returning
+      ~pool_invoker(){
+        {
+          std::lock_guard<std::mutex> lock(queue_mutex);
+          stopping = true;
+        }
+        queue_cv.notify_all();
+        for(auto &worker : workers) worker.join();
+      }
+      // Queues the message for any worker
+      void invoke(string inv_param_str){
+        {
+          std::lock_guard<std::mutex> lock(queue_mutex);
+          queue.push_back({std::nullopt, std::move(inv_param_str)});
+        }
+        queue_cv.notify_one();
+      }
+      // Queues the message behind earlier messages with the same strand key (e.g. a
+      // connection ID), which are run one at a time in order
+      void invoke(string inv_param_str, std::uint64_t strand){
+        {
+          std::lock_guard<std::mutex> lock(queue_mutex);
+          auto busy = strands.find(strand);
+          if(busy != strands.end()){
+            busy->second.push_back(std::move(inv_param_str));
+            return;
+          }
+          strands[strand];
+          queue.push_back({strand, std::move(inv_param_str)});
+        }
+        queue_cv.notify_one();
+      }
+      // Blocks until every queued call has run and its response has been sent
+      void drain(){
+        std::unique_lock<std::mutex> lock(queue_mutex);
+        idle_cv.wait(lock, [this]{ return running == 0 && queue.empty(); });
+      }
+  };
+  // Multi-producer single-consumer queue of messages (Vyukov's intrusive queue). push is
+  // lock-free apart from allocating the node, and never waits for other producers or the
+  // consumer. pop and empty may only be called by the one consumer.
+  class _mpsc_queue{
+    struct node_t{
+      std::atomic<node_t*> next{nullptr};
+      string message;
+    };
+    node_t stub;
+    std::atomic<node_t*> head{&stub};
+    // The last node popped, whose message has been moved out
+    node_t *tail = &stub;
+    public:
+      _mpsc_queue() = default;
+      _mpsc_queue(_mpsc_queue const &) = delete;
+      ~_mpsc_queue(){
+        string message;
+        while(pop(message));
+        if(tail != &stub) delete tail;
+      }
+      void push(string message){
+        node_t *node = new node_t;
+        node->message = std::move(message);
+        node_t *prev = head.exchange(node);
+        prev->next.store(node);
+      }
+      bool pop(string &message){
+        node_t *next = tail->next.load();
+        if(next == nullptr) return false;
+        message = std::move(next->message);
+        if(tail != &stub) delete tail;
+        tail = next;
+        return true;
+      }
+      // Can be true for a moment while a push is under way; the pusher checks for a
+      // sleeping consumer after the message is linked in
+      bool empty() const {return tail->next.load() == nullptr; }
+  };
+  // Invoker fed through lock-free queues, so transport threads receiving on several
+  // connections can all hand it messages without a lock between them. invoke pushes the
+  // message and returns, and dispatcher threads, each with its own queue, run the calls
+  // in batches and send the responses through send_fun, a batch per send_fun lock.
+  class queue_invoker : public invoker{
+    struct dispatcher_t{
+      _mpsc_queue queue;
+      std::atomic<bool> sleeping{false};
+      std::mutex mutex;
+      std::condition_variable cv;
+      std::thread thread;
+    };
+    std::vector<std::unique_ptr<dispatcher_t>> dispatchers;
+    std::size_t batch_size;
+    std::atomic<std::uint64_t> next_dispatcher{0};
+    std::atomic<bool> stopping{false};
+    // Messages pushed but not yet answered, for drain
+    std::atomic<std::size_t> pending{0};
+    std::mutex idle_mutex;
+    std::condition_variable idle_cv;
+
+    void dispatch(dispatcher_t &dispatcher){
+      serial_buffer response;
+      std::vector<string> responses;
+      string message;
+      while(true){
+        responses.clear();
+        while(responses.size() < batch_size && dispatcher.queue.pop(message)){
+          invoker::invoke(message, response);
+          responses.emplace_back(response.view());
+        }
+        if(!responses.empty()){
+          try{
+            std::lock_guard<std::mutex> send_lock(send_mutex);
+            for(auto &response_str : responses) send_fun(std::move(response_str));
+          }catch(...){
+            // Nowhere to report a transport failure from a dispatcher, the rest of the batch is dropped
+          }
+          if(pending.fetch_sub(responses.size()) == responses.size()){
+            std::lock_guard<std::mutex> lock(idle_mutex);
+            idle_cv.notify_all();
+          }
+          continue;
+        }
+        std::unique_lock<std::mutex> lock(dispatcher.mutex);
+        dispatcher.sleeping = true;
+        dispatcher.cv.wait(lock, [&]{ return stopping || !dispatcher.queue.empty(); });
+        dispatcher.sleeping = false;
+        if(stopping && dispatcher.queue.empty()) return;
+      }
+    }
+    public:
+      queue_invoker(transport_send_f _send_fun, std::size_t dispatcher_threads = 1, std::size_t _batch_size = 64,
+                    wire_format _format = wire_format::text) : invoker(std::move(_send_fun), _format){
+        batch_size = std::max<std::size_t>(_batch_size, 1);
+        for(std::size_t i = 0; i < std::max<std::size_t>(dispatcher_threads, 1); i++)
+          dispatchers.emplace_back(new dispatcher_t());
+        for(auto &dispatcher : dispatchers)
+          dispatcher->thread = std::thread(&queue_invoker::dispatch, this, std::ref(*dispatcher));
+      }
+      // Answers the queued messages before returning
+      ~queue_invoker(){
+        stopping = true;
+        for(auto &dispatcher : dispatchers){
+          std::lock_guard<std::mutex> lock(dispatcher->mutex);
+          dispatcher->cv.notify_one();
+        }
+        for(auto &dispatcher : dispatchers) dispatcher->thread.join();
+      }
+      // Queues the message for the next dispatcher in turn. Safe to call from any number of
+      // threads at once.
+      void invoke(string inv_param_str){
+        invoke(std::move(inv_param_str), next_dispatcher.fetch_add(1, std::memory_order_relaxed));
+      }
+      // Messages with the same key (e.g. a connection ID) go to the same dispatcher, which
+      // runs them in the order they were pushed
+      void invoke(string inv_param_str, std::uint64_t key){
+        dispatcher_t &dispatcher = *dispatchers[key % dispatchers.size()];
+        pending++;
+        dispatcher.queue.push(std::move(inv_param_str));
+        if(dispatcher.sleeping){
+          std::lock_guard<std::mutex> lock(dispatcher.mutex);
+          dispatcher.cv.notify_one();
+        }
+      }
+      // Blocks until every queued message has been answered
+      void drain(){
+        std::unique_lock<std::mutex> lock(idle_mutex);
+        idle_cv.wait(lock, [this]{ return pending == 0; });
+      }
+  };
+  // Invoker whose functions are fixed at compile time, e.g.
+  //   prpc::static_invoker<&get_int, &add_one> invoker(send_fun, {"get_int", "add_one"});
+  // Each function's numeric ID is its position in the list. Dispatch is an index into a
+  // table of functions that extract the args straight into the function's parameter types
+  // and call it directly, so there's no std::function in the way. Only function pointers
+  // can be template parameters, and there are no builtin prpc- functions.
+  template <auto ... FUNS>
+  class static_invoker{
+    static_assert(sizeof...(FUNS) > 0, "static_invoker needs at least one function");
+
+    template <auto FUN>
+    static void dispatch(from_serial &inv_params, to_serial &resp){
+      using function_signature = _fun_ptr_signature<decltype(FUN)>;
+      typename function_signature::args_tupl_t data;
+      inv_params.extract(data);
+
+      if(inv_params.has_conv_failed()){
+        resp.reinit("PRPC_INV_ARG_EXTRACT_FAILED");
+      }else if constexpr (std::is_void_v<typename function_signature::ret_t>){
+        std::apply(FUN, std::move(data));
+        resp.reinit("PRPC_GOOD");
+      }else{
+        auto ret = std::apply(FUN, std::move(data));
+        resp.reinit("PRPC_GOOD");
+        resp.append(ret);
+      }
+    }
+    static constexpr void (*dispatch_table[])(from_serial&, to_serial&) = { &dispatch<FUNS> ... };
+
+    transport_send_f send_fun;
+    wire_format format;
+    map<string, fun_num_t, std::less<>> fun_nums;
+    serial_buffer response_buf;
+    public:
+      static_invoker(transport_send_f _send_fun, wire_format _format = wire_format::text){
+        send_fun = std::move(_send_fun);
+        format = _format;
+      }
+      // fun_ids are the function ID strings, in the same order as the functions
+      static_invoker(transport_send_f _send_fun, std::array<string, sizeof...(FUNS)> fun_ids,
+                     wire_format _format = wire_format::text) : static_invoker(std::move(_send_fun), _format){
+        for(fun_num_t fun_num = 0; fun_num < fun_ids.size(); fun_num++){
+          if(fun_ids[fun_num].empty() || fun_ids[fun_num][0] == '#' || fun_ids[fun_num][0] == '@') throw std::exception();
+          if(!fun_nums.emplace(std::move(fun_ids[fun_num]), fun_num).second) throw std::exception();
+        }
+      }
+      void invoke(string inv_param_str){
+        invoke(std::string_view(inv_param_str), response_buf);
+        send_fun(string(response_buf.view()));
+      }
+      void invoke(std::string_view message, serial_buffer &response){
+        from_serial inv_params(message, format);
+        to_serial ret_param(response, format);
+        ret_param.corr_id = inv_params.corr_id;
+
+        std::size_t fun_num = sizeof...(FUNS);
+        if(inv_params.prefix_num){
+          fun_num = *inv_params.prefix_num;
+        }else{
+          auto it = fun_nums.find(inv_params.prefix_str);
+          if(it != fun_nums.end()) fun_num = it->second;
+        }
+
+        if(fun_num >= sizeof...(FUNS)){
           ret_param.reinit("PRPC_INV_FUN_NOEXIST");
         }else{
           try{
-            wrapped_functions[inv_params.prefix_str](inv_params, ret_param);
+            dispatch_table[fun_num](inv_params, ret_param);
           }catch(std::exception& e){
             ret_param.reinit("PRPC_INV_EXCEPT");
             ret_param.append(e.what());
           }
         }
-        send_fun(ret_param.serial());
+      }
+  };
+  // Holds a copy of a response message, inline if it's small enough, so results don't
+  // allocate for scalar returns and stay valid independently of each other and the caller.
+  // The value is extracted from it by as() each time.
+  class call_return final{
+    static constexpr std::size_t inline_size = 48;
+    std::size_t size = 0;
+    char inline_data[inline_size];
+    std::unique_ptr<char[]> heap_data;
+    wire_format format = wire_format::text;
+    string status_str;
+    // Unescaped copies of text-format strings that a std::string_view result points to
+    mutable std::forward_list<string> unquoted;
+
+    char *data(){return heap_data ? heap_data.get() : inline_data; }
+    char const *data() const {return heap_data ? heap_data.get() : inline_data; }
+    std::string_view message() const {return std::string_view(data(), size); }
+    void assign(std::string_view msg){
+      size = msg.size();
+      if(size > inline_size) heap_data.reset(new char[size]);
+      else heap_data.reset();
+      if(size != 0) std::memcpy(data(), msg.data(), size);
+    }
+    public:
+      call_return(std::string_view msg, wire_format _format){
+        format = _format;
+        assign(msg);
+        from_serial response(message(), format);
+        status_str = std::move(response.prefix_str);
+      }
+      call_return(call_return const &other) : format(other.format), status_str(other.status_str) {
+        assign(other.message());
+      }
+      call_return(call_return &&other) noexcept : size(other.size), heap_data(std::move(other.heap_data)),
+                                                  format(other.format), status_str(std::move(other.status_str)),
+                                                  unquoted(std::move(other.unquoted)) {
+        if(!heap_data) std::memcpy(inline_data, other.inline_data, size);
+      }
+      call_return &operator=(call_return other) noexcept {
+        size = other.size;
+        heap_data = std::move(other.heap_data);
+        if(!heap_data) std::memcpy(inline_data, other.inline_data, size);
+        format = other.format;
+        status_str = std::move(other.status_str);
+        unquoted = std::move(other.unquoted);
+        return *this;
+      }
+
+      // Throws the exception matching an error status
+      static void check_status(std::string_view status){
+        if (status == "PRPC_GOOD") {
+          return;
+        }
+        else if (status == "PRPC_INV_FUN_NOEXIST") {
+          throw UnknownFunctionException();
+        }
+        else if (status == "PRPC_INV_ARG_EXTRACT_FAILED") {
+          throw BadArgListException();
+        }
+        else {
+          throw UnknownInvokerException();
+        }
+      }
+      // "PRPC_GOOD" unless the call failed, in which case as() throws
+      string const &status() const {return status_str; }
+      // A std::string_view points into this call_return, so it has to outlive the view
+      template <typename T>
+      T as() const {
+        using Type = std::decay_t<T>;
+
+        check_status(status_str);
+        from_serial response(message(), format);
+        Type data{};
+        response.extract_arg_value(data);
+        unquoted.splice_after(unquoted.before_begin(), response.unquoted);
+        return data;
+      }
+
+      template <typename T>
+      operator T () const
+      {
+          return as<T>();
       }
   };
   class caller{
     transport_sendrec_f sendrec_fun;
-    class call_return final{
-      mutable std::optional<std::any> value;
-      from_serial *rp;
+    transport_sendrec_view_f sendrec_view_fun;
+    wire_format format;
+    serial_buffer request;
+    string response;
+    map<string, fun_num_t> fun_nums;
+    // prpc-list-functions hash of the table fun_nums came from, 0 before the first fetch
+    std::uint64_t fun_table_hash = 0;
+    // Results of the functions passed to memoize, keyed on the serialized call, and the
+    // same caches by numeric ID
+    map<string, std::unique_ptr<_response_cache>> memos;
+    std::unordered_map<fun_num_t, _response_cache*> memos_by_num;
+
+    call_return receive(std::string_view response_view){
+      call_return result(response_view, format);
+      call_return::check_status(result.status());
+      return result;
+    }
+    _response_cache *find_memo(string const &fun_id){
+      if(memos.empty()) return nullptr;
+      auto memo = memos.find(fun_id);
+      return memo == memos.end() ? nullptr : memo->second.get();
+    }
+    _response_cache *find_memo(fun_num_t fun_num){
+      if(memos_by_num.empty()) return nullptr;
+      auto memo = memos_by_num.find(fun_num);
+      return memo == memos_by_num.end() ? nullptr : memo->second;
+    }
+    void index_memos(){
+      memos_by_num.clear();
+      for(auto &memo : memos){
+        auto fun_num = fun_nums.find(memo.first);
+        if(fun_num != fun_nums.end()) memos_by_num[fun_num->second] = memo.second.get();
+      }
+    }
+    call_return sendrec_memo(std::string_view message, _response_cache *memo){
+      std::optional<call_return> hit;
+      if(memo && memo->find(message, [&](std::string_view cached){ hit.emplace(cached, format); })) return std::move(*hit);
+      if(sendrec_view_fun) sendrec_view_fun(message, response);
+      else response = sendrec_fun(string(message));
+      auto result = receive(response);
+      if(memo) memo->insert(message, response);
+      return result;
+    }
+    template <typename PREFIX_T, typename ARGS_T>
+    call_return sendrec(PREFIX_T const &prefix, ARGS_T const &args){
+      to_serial params(request, prefix, format);
+      params.insert(args);
+      return sendrec_memo(request.view(), find_memo(prefix));
+    }
+    public:
+    // Collects calls into one prpc-batch message, so they cost one transport round
+    // trip. The invoker runs them in order.
+    class batch{
+      caller &parent;
+      serial_buffer message;
+      serial_buffer entry;
+      to_serial params;
+      std::size_t size = 0;
       public:
-        call_return(from_serial *serial_param){
-          rp = serial_param;
+        batch(caller &_parent) : parent(_parent), params(message, "prpc-batch", _parent.format) {}
+        template <typename ... TArgs>
+        batch &add(fun_num_t fun_num, TArgs && ... args){
+          to_serial entry_params(entry, fun_num, parent.format);
+          entry_params.insert(std::forward_as_tuple(std::forward<TArgs>(args) ... ));
+          params.insert_value(entry.view());
+          size++;
+          return *this;
         }
-        template <typename T>
-        T as() const {
-          using Type = std::decay_t<T>;
-
-          if (!value){
-            Type data{};
-            rp->extract_arg_value(data);
-            value = std::move(data);
-          }
+        template <typename ... TArgs>
+        batch &add(string fun_id, TArgs && ... args){
+          auto fun_num = parent.fun_nums.find(fun_id);
+          if(fun_num != parent.fun_nums.end()) return add(fun_num->second, std::forward<TArgs>(args) ... );
 
-          return std::any_cast<Type>(*value);
+          to_serial entry_params(entry, fun_id, parent.format);
+          entry_params.insert(std::forward_as_tuple(std::forward<TArgs>(args) ... ));
+          params.insert_value(entry.view());
+          size++;
+          return *this;
         }
+        // One result per add(), in order. Each has its own status: as() on a call that
+        // failed throws. Throws itself only if the batch as a whole failed.
+        std::vector<call_return> send(){
+          string response_str;
+          if(parent.sendrec_view_fun) parent.sendrec_view_fun(message.view(), response_str);
+          else response_str = parent.sendrec_fun(string(message.view()));
 
-        template <typename T>
-        operator T () const
-        {
-            return as<T>();
+          from_serial response(response_str, parent.format);
+          call_return::check_status(response.prefix_str);
+          std::vector<call_return> results;
+          results.reserve(size);
+          while(!response.at_end()){
+            std::string_view entry_response;
+            response.extract_arg_value(entry_response);
+            if(response.msg_strm.fail()) throw UnknownInvokerException();
+            results.emplace_back(entry_response, parent.format);
+          }
+          if(results.size() != size) throw UnknownInvokerException();
+          return results;
         }
     };
-    from_serial *rp = nullptr;
-    public:
-    caller(transport_sendrec_f _rec_fun){
+    batch make_batch(){ return batch(*this); }
+
+    caller(transport_sendrec_f _rec_fun, wire_format _format = wire_format::text){
       sendrec_fun = std::move(_rec_fun);
+      format = _format;
       //string remote_version=call("prpc-get-version");
       //assert(("prpc::invoker version is not the same as this version" && (remote_version) == PRPC_VERSION_STR));
     }
+    // The request and response buffers are reused for every call, so with the binary
+    // format a call doesn't allocate once they have grown large enough. request_resource
+    // provides the request buffer's storage.
+    caller(transport_sendrec_view_f _rec_fun, wire_format _format = wire_format::text,
+           std::pmr::memory_resource *request_resource = std::pmr::get_default_resource()) : request(request_resource){
+      sendrec_view_fun = std::move(_rec_fun);
+      format = _format;
+    }
+    // Fetch the numeric IDs of all the invoker's functions with one prpc-list-functions
+    // call. After this call(fun_id, ...) sends the numeric ID instead of the function ID
+    // string. Fetching again only transfers the table if it has changed since.
+    map<string, fun_num_t> const &fetch_fun_nums(){
+      auto [table_hash, rows] = call("prpc-list-functions", fun_table_hash)
+                                  .as<std::pair<std::uint64_t, std::vector<function_row>>>();
+      if(table_hash == fun_table_hash) return fun_nums;
+      fun_nums.clear();
+      for(auto &[fun_id, argspec, fun_num] : rows) fun_nums[std::move(fun_id)] = fun_num;
+      fun_table_hash = table_hash;
+      index_memos();
+      return fun_nums;
+    }
+    // Keeps the results of fun_id's successful calls, so a call with the same args is
+    // answered locally until the result expires, is evicted or is invalidated. Only for
+    // functions whose result changes rarely.
+    void memoize(string const &fun_id, cache_options options){
+      if(options.capacity == 0) memos.erase(fun_id);
+      else memos[fun_id].reset(new _response_cache(options));
+      index_memos();
+    }
+    // Drops the memoized results of fun_id
+    void invalidate(string const &fun_id){
+      if(auto memo = find_memo(fun_id)) memo->clear();
+    }
+    // Drops every memoized result
+    void invalidate(){
+      for(auto &memo : memos) memo.second->clear();
+    }
+    // Hits, misses and the number of memoized results of fun_id
+    cache_stats get_cache_stats(string const &fun_id){
+      auto memo = find_memo(fun_id);
+      return memo ? memo->get_stats() : cache_stats{};
+    }
+    // Handles a message sent by invoker::send_invalidation. Transports that can receive
+    // messages the caller didn't ask for pass them here. Returns false for other messages.
+    bool receive_invalidation(std::string_view message){
+      from_serial invalidation(message, format);
+      if(invalidation.prefix_str != "PRPC_INVALIDATE") return false;
+      string fun_id;
+      invalidation.extract_arg_value(fun_id);
+      if(invalidation.msg_strm.fail()) return false;
+      if(fun_id.empty()) invalidate();
+      else invalidate(fun_id);
+      return true;
+    }
+    template <typename ... TArgs>
+    call_return call(fun_num_t fun_num, TArgs && ... args)
+    {
+      return sendrec(fun_num, std::forward_as_tuple(std::forward<TArgs>(args) ... ));
+    }
     template <typename ... TArgs>
     call_return call(string fun_id, TArgs && ... args)
     {
-      auto data = std::make_tuple(std::forward<TArgs>(args) ... );
+      auto fun_num = fun_nums.find(fun_id);
+      if(fun_num != fun_nums.end()) return call(fun_num->second, std::forward<TArgs>(args) ... );
 
-      to_serial params(fun_id);
-      params.insert(data);
+      return sendrec(fun_id, std::forward_as_tuple(std::forward<TArgs>(args) ... ));
+    }
+    call_return call(string fun_inv_string) {
+      auto fun_num = fun_nums.find(fun_inv_string);
+      if(fun_num != fun_nums.end()) return call(fun_num->second);
+
+      // A binary message can't be written by hand, so the string is just the function ID
+      if(format == wire_format::binary) return sendrec(fun_inv_string, std::tuple<>());
+      return sendrec_memo(fun_inv_string, find_memo(fun_inv_string.substr(0, fun_inv_string.find(' '))));
+    }
+    // Sends an already serialized message. The response is written into response_buf.
+    call_return call_serial(std::string_view message, string &response_buf){
+      if(sendrec_view_fun) sendrec_view_fun(message, response_buf);
+      else response_buf = sendrec_fun(string(message));
+      return receive(response_buf);
+    }
+  };
+  // Sends calls without waiting for the response, so many calls can be in flight on one
+  // connection. Each request is tagged with a correlation ID, and the transport passes
+  // every message it receives from the invoker to receive(), in any order.
+  class async_caller{
+    transport_send_f send_fun;
+    wire_format format;
+    std::mutex pending_mutex;
+    corr_id_t next_corr_id = 0;
+#if PRPC_HAS_COROUTINES
+    // A coroutine suspended in co_await call(...). Whichever of await_suspend and receive
+    // gets to done second carries on: receive resumes the coroutine, await_suspend doesn't
+    // suspend it.
+    struct call_waiter{
+      std::optional<call_return> result;
+      std::exception_ptr error;
+      std::coroutine_handle<> handle;
+      std::atomic<bool> done{false};
 
-      string response = sendrec_fun(params.serial());
+      void complete(){ if(done.exchange(true)) handle.resume(); }
+    };
+#else
+    struct call_waiter;
+#endif
+    // A call waiting for its response, completed through the promise of call_async or
+    // through the waiter of co_await call
+    struct pending_t{
+      std::optional<std::promise<call_return>> promise;
+      call_waiter *waiter = nullptr;
+    };
+    std::unordered_map<corr_id_t, pending_t> pending;
+    // Receivers of the chunks of call_chunked results
+    std::unordered_map<corr_id_t, function<void(std::string_view)>> chunk_sinks;
 
-      //FIXME: ugly memory management
-      if (rp) delete rp;
-      rp = new from_serial(response);
-      if (rp->prefix_str == "PRPC_GOOD") {
-        return call_return(rp);
-      }
-      else if (rp->prefix_str == "PRPC_INV_FUN_NOEXIST") {
-        throw UnknownFunctionException();
+    template <typename T>
+    static void insert_head(to_serial &params, T const &arg){ params.insert_value(arg); }
+    static void insert_head(to_serial &, chunk_source const &){}
+    template <typename T>
+    void send_chunks(T const &, corr_id_t){}
+    void send_chunks(chunk_source const &source, corr_id_t corr_id){
+      serial_buffer message;
+      string chunk;
+      while(source(chunk)){
+        to_serial params(message, "prpc-chunk", format, corr_id);
+        params.insert_value(chunk);
+        send_fun(string(message.view()));
       }
-      else if (rp->prefix_str == "PRPC_INV_ARG_EXTRACT_FAILED") {
-        throw BadArgListException();
+      to_serial end_msg(message, "prpc-chunk-end", format, corr_id);
+      send_fun(string(message.view()));
+    }
+    template <typename PREFIX_T, typename ARGS_T>
+    std::future<call_return> send(PREFIX_T const &prefix, ARGS_T const &args, function<void(std::string_view)> on_chunk = nullptr){
+      pending_t entry;
+      std::future<call_return> result = entry.promise.emplace().get_future();
+      send(prefix, args, std::move(entry), std::move(on_chunk));
+      return result;
+    }
+    template <typename PREFIX_T, typename ARGS_T>
+    void send(PREFIX_T const &prefix, ARGS_T const &args, pending_t entry, function<void(std::string_view)> on_chunk){
+      serial_buffer request;
+      corr_id_t corr_id;
+      {
+        std::lock_guard<std::mutex> lock(pending_mutex);
+        corr_id = next_corr_id++;
+        pending[corr_id] = std::move(entry);
+        if(on_chunk) chunk_sinks[corr_id] = std::move(on_chunk);
       }
-      else {
-        throw UnknownInvokerException();
+      try{
+        to_serial params(request, prefix, format, corr_id);
+        // The response can arrive before send_fun returns, so the lock can't be held here
+        if constexpr (_has_chunk_source<ARGS_T>){
+          std::apply([&params](auto const & ... arg){ (insert_head(params, arg), ...); }, args);
+          send_fun(string(request.view()));
+          std::apply([this, corr_id](auto const & ... arg){ (send_chunks(arg, corr_id), ...); }, args);
+        }else{
+          params.insert(args);
+          send_fun(string(request.view()));
+        }
+      }catch(...){
+        std::lock_guard<std::mutex> lock(pending_mutex);
+        pending.erase(corr_id);
+        chunk_sinks.erase(corr_id);
+        throw;
       }
     }
-    call_return call(string fun_inv_string) {
-      string response = sendrec_fun(fun_inv_string);
-
-      // FIXME: ugly memory management
-      if (rp) delete rp;
-      rp = new from_serial(response);
-      if (rp->prefix_str == "PRPC_GOOD") {
-        return call_return(rp);
+#if PRPC_HAS_COROUTINES
+    template <typename PREFIX_T, typename ARGS_T>
+    class call_awaiter : call_waiter{
+      async_caller &caller;
+      PREFIX_T prefix;
+      ARGS_T args;
+      public:
+        call_awaiter(async_caller &_caller, PREFIX_T _prefix, ARGS_T _args) :
+          caller(_caller), prefix(std::move(_prefix)), args(std::move(_args)) {}
+        bool await_ready() const noexcept {return false; }
+        bool await_suspend(std::coroutine_handle<> awaiting){
+          handle = awaiting;
+          pending_t entry;
+          entry.waiter = this;
+          caller.send(prefix, args, std::move(entry), nullptr);
+          return !done.exchange(true);
+        }
+        call_return await_resume(){
+          if(error) std::rethrow_exception(error);
+          return std::move(*result);
+        }
+    };
+#endif
+    public:
+      async_caller(transport_send_f _send_fun, wire_format _format = wire_format::text){
+        send_fun = std::move(_send_fun);
+        format = _format;
       }
-      else if (rp->prefix_str == "PRPC_INV_FUN_NOEXIST") {
-        throw UnknownFunctionException();
+      template <typename ... TArgs>
+      std::future<call_return> call_async(fun_num_t fun_num, TArgs && ... args){
+        return send(fun_num, std::forward_as_tuple(std::forward<TArgs>(args) ... ));
       }
-      else if (rp->prefix_str == "PRPC_INV_ARG_EXTRACT_FAILED") {
-        throw BadArgListException();
+      template <typename ... TArgs>
+      std::future<call_return> call_async(string fun_id, TArgs && ... args){
+        return send(fun_id, std::forward_as_tuple(std::forward<TArgs>(args) ... ));
       }
-      else {
-        throw UnknownInvokerException();
+#if PRPC_HAS_COROUTINES
+      // Awaitable call, e.g. in a coroutine function
+      //   call_return result = co_await downstream.call("lookup", key);
+      // The request is sent when the call is awaited, and the coroutine is resumed from
+      // receive(). Error statuses are thrown from the co_await. Await it in the statement
+      // that makes it, the args are held by reference.
+      template <typename ... TArgs>
+      auto call(fun_num_t fun_num, TArgs && ... args){
+        return call_awaiter<fun_num_t, std::tuple<TArgs&& ... >>(*this, fun_num, std::forward_as_tuple(std::forward<TArgs>(args) ... ));
+      }
+      template <typename ... TArgs>
+      auto call(string fun_id, TArgs && ... args){
+        return call_awaiter<string, std::tuple<TArgs&& ... >>(*this, std::move(fun_id), std::forward_as_tuple(std::forward<TArgs>(args) ... ));
+      }
+#endif
+      // For a function that returns a chunk_source. receive() passes each chunk to
+      // on_chunk as it arrives, and the future completes after the last one. The
+      // transport has to deliver the messages of one call in order.
+      template <typename ... TArgs>
+      std::future<call_return> call_chunked(function<void(std::string_view)> on_chunk, fun_num_t fun_num, TArgs && ... args){
+        return send(fun_num, std::forward_as_tuple(std::forward<TArgs>(args) ... ), std::move(on_chunk));
+      }
+      template <typename ... TArgs>
+      std::future<call_return> call_chunked(function<void(std::string_view)> on_chunk, string fun_id, TArgs && ... args){
+        return send(fun_id, std::forward_as_tuple(std::forward<TArgs>(args) ... ), std::move(on_chunk));
+      }
+      // Completes the future of the call that message is the response to. Error statuses
+      // are stored in the future as the same exceptions caller::call throws. Returns false
+      // if message isn't the response to a pending call.
+      bool receive(string message){
+        from_serial response(message, format);
+        if(!response.corr_id) return false;
+
+        if(response.prefix_str == "PRPC_CHUNK"){
+          function<void(std::string_view)> *sink;
+          {
+            std::lock_guard<std::mutex> lock(pending_mutex);
+            auto it = chunk_sinks.find(*response.corr_id);
+            if(it == chunk_sinks.end()) return false;
+            // Stays valid until the call's last message, which comes after this one
+            sink = &it->second;
+          }
+          std::string_view chunk;
+          response.extract_arg_value(chunk);
+          if(response.msg_strm.fail()) return false;
+          (*sink)(chunk);
+          return true;
+        }
+
+        pending_t entry;
+        {
+          std::lock_guard<std::mutex> lock(pending_mutex);
+          auto it = pending.find(*response.corr_id);
+          if(it == pending.end()) return false;
+          entry = std::move(it->second);
+          pending.erase(it);
+          chunk_sinks.erase(*response.corr_id);
+        }
+#if PRPC_HAS_COROUTINES
+        if(entry.waiter){
+          try{
+            call_return::check_status(response.prefix_str);
+            entry.waiter->result.emplace(message, format);
+          }catch(...){
+            entry.waiter->error = std::current_exception();
+          }
+          entry.waiter->complete();
+          return true;
+        }
+#endif
+        try{
+          call_return::check_status(response.prefix_str);
+          entry.promise->set_value(call_return(message, format));
+        }catch(...){
+          entry.promise->set_exception(std::current_exception());
+        }
+        return true;
+      }
+      // Number of calls still waiting for a response
+      std::size_t in_flight(){
+        std::lock_guard<std::mutex> lock(pending_mutex);
+        return pending.size();
       }
-    }
   };
 }
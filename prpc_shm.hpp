@@ -0,0 +1,309 @@
+// Copyright (C) 2021 Stuart Duncan
+//
+// This file is part of picoRPC.
+//
+// picoRPC is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// picoRPC is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with picoRPC.  If not, see <http://www.gnu.org/licenses/>.
+
+#pragma once
+
+// Optional shared-memory transport for calls between processes on one Linux host. A
+// segment holds two single-producer single-consumer byte rings, one for requests and one
+// for responses. Each message is its length as 4 bytes followed by its bytes, and may be
+// larger than a ring, it is then passed through in pieces.
+
+#include "prpc.hpp"
+#include <system_error>
+#include <utility>
+#include <cerrno>
+#include <climits>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+namespace prpc{
+  static_assert(std::atomic<std::uint64_t>::is_always_lock_free && std::atomic<std::uint32_t>::is_always_lock_free,
+                "the shared-memory transport needs lock-free atomics to share them between processes");
+
+  // Longest message receive accepts. A longer length can only come from a broken peer.
+  constexpr std::size_t shm_max_message_size = 64 * 1024 * 1024;
+
+  // One direction. head and tail count every byte written and read, the data is at
+  // head % capacity. A side that runs out of data or space spins a little and then
+  // sleeps on a futex, which the other side only wakes if it says it is waiting.
+  struct _shm_ring{
+    alignas(64) std::atomic<std::uint64_t> head;
+    std::atomic<std::uint32_t> data_seq;
+    std::atomic<std::uint32_t> consumer_waiting;
+    alignas(64) std::atomic<std::uint64_t> tail;
+    std::atomic<std::uint32_t> space_seq;
+    std::atomic<std::uint32_t> producer_waiting;
+  };
+  struct _shm_header{
+    static constexpr std::uint32_t magic_value = 0x63707270;
+    std::uint32_t magic;
+    std::uint32_t capacity;
+    std::atomic<std::uint32_t> closed;
+    _shm_ring rings[2];
+  };
+
+  // One end of a shared-memory connection, for one thread at a time. The server end
+  // creates the segment and the client end opens it, e.g.
+  //   auto server = prpc::shm_channel::create("/my-service");
+  //   prpc::invoker srv([&server](string msg){ server.send(msg); });
+  //   string request;
+  //   while(server.receive(request)) srv.invoke(std::move(request));
+  // and in the other process
+  //   auto client = prpc::shm_channel::open("/my-service");
+  //   prpc::caller cl([&client](std::string_view msg, string &response){ client.sendrec(msg, response); });
+  // Throws std::system_error if the segment can't be set up.
+  class shm_channel{
+    // Spinning only pays when the other end runs on another CPU meanwhile
+    static int spin_count(){
+      static int const count = std::thread::hardware_concurrency() > 1 ? 2000 : 0;
+      return count;
+    }
+    // How often a sleeping side checks whether the other end has gone
+    static constexpr long sleep_ns = 100 * 1000 * 1000;
+
+    int fd = -1;
+    string name;
+    bool owner = false;
+    _shm_header *header = nullptr;
+    std::size_t mapped_size = 0;
+    _shm_ring *in_ring = nullptr;
+    _shm_ring *out_ring = nullptr;
+    char *in_data = nullptr;
+    char *out_data = nullptr;
+
+    static void throw_errno(char const *what){ throw std::system_error(errno, std::generic_category(), what); }
+    static void cpu_relax(){
+#if defined(__SSE2__)
+      _mm_pause();
+#endif
+    }
+    static void futex_wait(std::atomic<std::uint32_t> &word, std::uint32_t value){
+      timespec timeout{0, sleep_ns};
+      syscall(SYS_futex, reinterpret_cast<std::uint32_t*>(&word), FUTEX_WAIT, value, &timeout, nullptr, 0);
+    }
+    static void futex_wake(std::atomic<std::uint32_t> &word){
+      syscall(SYS_futex, reinterpret_cast<std::uint32_t*>(&word), FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+    }
+    // Returns false if the channel closed first
+    template <typename READY_T>
+    bool wait(std::atomic<std::uint32_t> &seq, std::atomic<std::uint32_t> &waiting, READY_T ready){
+      for(int i = 0, spins = spin_count(); i < spins; i++){
+        if(ready()) return true;
+        cpu_relax();
+      }
+      for(;;){
+        std::uint32_t seen = seq.load();
+        waiting.store(1);
+        bool is_ready = ready();
+        if(is_ready || header->closed.load()){
+          waiting.store(0);
+          return is_ready;
+        }
+        futex_wait(seq, seen);
+        waiting.store(0);
+      }
+    }
+    static void notify(std::atomic<std::uint32_t> &seq, std::atomic<std::uint32_t> &waiting){
+      if(waiting.load()){
+        seq.fetch_add(1);
+        futex_wake(seq);
+      }
+    }
+    void write_bytes(char const *data, std::size_t size){
+      std::uint32_t capacity = header->capacity;
+      std::uint64_t head = out_ring->head.load(std::memory_order_relaxed);
+      while(size != 0){
+        std::uint64_t tail = out_ring->tail.load(std::memory_order_acquire);
+        if(head - tail == capacity){
+          auto has_space = [this, head]{ return head - out_ring->tail.load() != header->capacity; };
+          if(!wait(out_ring->space_seq, out_ring->producer_waiting, has_space)){
+            throw std::system_error(std::make_error_code(std::errc::broken_pipe), "shm_channel closed");
+          }
+          continue;
+        }
+        std::size_t offset = head % capacity;
+        std::size_t count = std::min<std::size_t>({size, capacity - (head - tail), capacity - offset});
+        std::memcpy(out_data + offset, data, count);
+        head += count;
+        data += count;
+        size -= count;
+        out_ring->head.store(head);
+        notify(out_ring->data_seq, out_ring->consumer_waiting);
+      }
+    }
+    bool read_bytes(char *data, std::size_t size){
+      std::uint32_t capacity = header->capacity;
+      std::uint64_t tail = in_ring->tail.load(std::memory_order_relaxed);
+      while(size != 0){
+        std::uint64_t head = in_ring->head.load(std::memory_order_acquire);
+        if(head == tail){
+          auto has_data = [this, tail]{ return in_ring->head.load() != tail; };
+          if(!wait(in_ring->data_seq, in_ring->consumer_waiting, has_data)) return false;
+          continue;
+        }
+        std::size_t offset = tail % capacity;
+        std::size_t count = std::min<std::size_t>({size, head - tail, capacity - offset});
+        std::memcpy(data, in_data + offset, count);
+        tail += count;
+        data += count;
+        size -= count;
+        in_ring->tail.store(tail);
+        notify(in_ring->space_seq, in_ring->producer_waiting);
+      }
+      return true;
+    }
+    void map(bool server){
+      struct stat st;
+      if(fstat(fd, &st) != 0) throw_errno("fstat");
+      mapped_size = st.st_size;
+      void *addr = mmap(nullptr, mapped_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+      if(addr == MAP_FAILED) throw_errno("mmap");
+      header = static_cast<_shm_header*>(addr);
+      if(mapped_size < sizeof(_shm_header) || header->magic != _shm_header::magic_value ||
+         mapped_size < sizeof(_shm_header) + 2 * std::size_t(header->capacity)){
+        throw std::system_error(std::make_error_code(std::errc::invalid_argument), "not a prpc shm segment");
+      }
+      char *data = reinterpret_cast<char*>(header + 1);
+      int in = server ? 0 : 1;
+      in_ring = &header->rings[in];
+      out_ring = &header->rings[1 - in];
+      in_data = data + in * header->capacity;
+      out_data = data + (1 - in) * header->capacity;
+    }
+    void init(std::uint32_t capacity){
+      if(ftruncate(fd, sizeof(_shm_header) + 2 * std::size_t(capacity)) != 0) throw_errno("ftruncate");
+      void *addr = mmap(nullptr, sizeof(_shm_header), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+      if(addr == MAP_FAILED) throw_errno("mmap");
+      auto init_header = new (addr) _shm_header{};
+      init_header->capacity = capacity;
+      std::atomic_thread_fence(std::memory_order_release);
+      init_header->magic = _shm_header::magic_value;
+      munmap(addr, sizeof(_shm_header));
+    }
+    void release(){
+      if(header) munmap(header, mapped_size);
+      if(fd >= 0) ::close(fd);
+      if(owner && !name.empty()) shm_unlink(name.c_str());
+      header = nullptr;
+      fd = -1;
+    }
+    shm_channel() = default;
+    public:
+      // Server end of a new segment with rings of capacity bytes each. With a name the
+      // segment is a POSIX shared memory object that open finds, removed again when this
+      // end is destroyed. Without one it is an anonymous memfd, which the client gets by
+      // inheriting or being sent get_fd().
+      static shm_channel create(string const &name = {}, std::uint32_t capacity = 1 << 20){
+        if(capacity < 64) throw std::exception();
+        shm_channel channel;
+        if(name.empty()) channel.fd = memfd_create("prpc", MFD_CLOEXEC);
+        else channel.fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+        if(channel.fd < 0) throw_errno(name.empty() ? "memfd_create" : "shm_open");
+        channel.name = name;
+        channel.owner = true;
+        channel.init(capacity);
+        channel.map(true);
+        return channel;
+      }
+      // Client end of the segment that create made with name
+      static shm_channel open(string const &name){
+        shm_channel channel;
+        channel.fd = shm_open(name.c_str(), O_RDWR | O_CLOEXEC, 0);
+        if(channel.fd < 0) throw_errno("shm_open");
+        channel.map(false);
+        return channel;
+      }
+      // Client end of the segment behind a descriptor of the server end's get_fd()
+      static shm_channel open(int segment_fd){
+        shm_channel channel;
+        channel.fd = dup(segment_fd);
+        if(channel.fd < 0) throw_errno("dup");
+        channel.map(false);
+        return channel;
+      }
+      shm_channel(shm_channel &&other) noexcept { *this = std::move(other); }
+      shm_channel &operator=(shm_channel &&other) noexcept {
+        if(this != &other){
+          release();
+          fd = std::exchange(other.fd, -1);
+          name = std::move(other.name);
+          owner = std::exchange(other.owner, false);
+          header = std::exchange(other.header, nullptr);
+          mapped_size = other.mapped_size;
+          in_ring = other.in_ring;
+          out_ring = other.out_ring;
+          in_data = other.in_data;
+          out_data = other.out_data;
+        }
+        return *this;
+      }
+      ~shm_channel(){ release(); }
+
+      int get_fd() const {return fd; }
+      // Blocks while the other end has a ring's worth of data to read. Throws
+      // std::system_error if the channel is closed or message is longer than
+      // shm_max_message_size.
+      void send(std::string_view message){
+        if(message.size() > shm_max_message_size) throw std::system_error(std::make_error_code(std::errc::message_size), "shm_channel send");
+        if(header->closed.load()) throw std::system_error(std::make_error_code(std::errc::broken_pipe), "shm_channel closed");
+        auto size = static_cast<std::uint32_t>(message.size());
+        char length[4] = {char(size), char(size >> 8), char(size >> 16), char(size >> 24)};
+        write_bytes(length, 4);
+        write_bytes(message.data(), message.size());
+      }
+      // Blocks until a message arrives, returns false once the channel is closed and
+      // there are no messages left. A length over shm_max_message_size closes the channel.
+      // message's capacity is reused.
+      bool receive(string &message){
+        unsigned char length[4];
+        if(!read_bytes(reinterpret_cast<char*>(length), 4)) return false;
+        std::uint32_t size = length[0] | length[1] << 8 | length[2] << 16 | std::uint32_t(length[3]) << 24;
+        if(size > shm_max_message_size){
+          close();
+          return false;
+        }
+        message.resize(size);
+        return read_bytes(message.data(), message.size());
+      }
+      void sendrec(std::string_view message, string &response){
+        send(message);
+        if(!receive(response)) throw std::system_error(std::make_error_code(std::errc::broken_pipe), "shm_channel closed");
+      }
+      string sendrec(string message){
+        string response;
+        sendrec(message, response);
+        return response;
+      }
+      // Makes receive return false at both ends, once they have read what was sent
+      void close(){
+        header->closed.store(1);
+        for(auto &ring : header->rings){
+          ring.data_seq.fetch_add(1);
+          futex_wake(ring.data_seq);
+          ring.space_seq.fetch_add(1);
+          futex_wake(ring.space_seq);
+        }
+      }
+  };
+}
@@ -0,0 +1,454 @@
+// Copyright (C) 2021 Stuart Duncan
+//
+// This file is part of picoRPC.
+//
+// picoRPC is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// picoRPC is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with picoRPC.  If not, see <http://www.gnu.org/licenses/>.
+
+#pragma once
+
+// Optional TCP transport for Linux. Every message is sent as a frame: its length as a
+// 4 byte little-endian number, then its bytes.
+
+#include "prpc.hpp"
+#include <system_error>
+#include <cerrno>
+#include <unistd.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+namespace prpc{
+  // Frames longer than this close the connection
+  constexpr std::size_t tcp_max_frame_size = 64 * 1024 * 1024;
+
+  inline void _tcp_throw(char const *what){ throw std::system_error(errno, std::generic_category(), what); }
+
+  inline void _tcp_append_frame(string &out, std::string_view message){
+    auto size = static_cast<std::uint32_t>(message.size());
+    char header[4] = {char(size), char(size >> 8), char(size >> 16), char(size >> 24)};
+    out.append(header, 4);
+    out.append(message);
+  }
+  inline std::uint32_t _tcp_frame_size(char const *header){
+    auto byte = [header](int i){ return std::uint32_t(static_cast<unsigned char>(header[i])); };
+    return byte(0) | byte(1) << 8 | byte(2) << 16 | byte(3) << 24;
+  }
+
+  // Passes the whole frames at the front of in to on_message and removes them. Returns
+  // false, and stops, at a frame longer than tcp_max_frame_size or when on_message throws.
+  inline bool _tcp_read_frames(string &in, function<void(string)> const &on_message){
+    std::size_t pos = 0;
+    bool ok = true;
+    while(in.size() - pos >= 4){
+      std::size_t size = _tcp_frame_size(in.data() + pos);
+      if(size > tcp_max_frame_size){
+        ok = false;
+        break;
+      }
+      if(in.size() - pos - 4 < size) break;
+      string message = in.substr(pos + 4, size);
+      pos += 4 + size;
+      try{
+        on_message(std::move(message));
+      }catch(...){
+        ok = false;
+        break;
+      }
+    }
+    in.erase(0, pos);
+    return ok;
+  }
+
+  // Connected socket of host:port, the first address that accepts, with TCP_NODELAY set
+  inline int _tcp_connect(string const &host, std::uint16_t port){
+    addrinfo hints{};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo *addrs = nullptr;
+    if(int err = getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints, &addrs); err != 0){
+      throw std::system_error(std::make_error_code(std::errc::host_unreachable), gai_strerror(err));
+    }
+    int fd = -1;
+    for(addrinfo *addr = addrs; addr && fd < 0; addr = addr->ai_next){
+      fd = socket(addr->ai_family, addr->ai_socktype | SOCK_CLOEXEC, addr->ai_protocol);
+      if(fd >= 0 && connect(fd, addr->ai_addr, addr->ai_addrlen) != 0){
+        close(fd);
+        fd = -1;
+      }
+    }
+    freeaddrinfo(addrs);
+    if(fd < 0) _tcp_throw("connect");
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd;
+  }
+
+  // Non-blocking listening socket on address:port. port 0 picks a free port, which is
+  // written back into port.
+  inline int _tcp_listen(string const &address, std::uint16_t &port){
+    addrinfo hints{};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE | AI_NUMERICHOST;
+    addrinfo *addrs = nullptr;
+    if(int err = getaddrinfo(address.c_str(), std::to_string(port).c_str(), &hints, &addrs); err != 0){
+      throw std::system_error(std::make_error_code(std::errc::invalid_argument), gai_strerror(err));
+    }
+    int fd = socket(addrs->ai_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    int one = 1;
+    bool ok = fd >= 0 && setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) == 0 &&
+              bind(fd, addrs->ai_addr, addrs->ai_addrlen) == 0 && ::listen(fd, SOMAXCONN) == 0;
+    freeaddrinfo(addrs);
+    if(!ok){
+      int err = errno;
+      if(fd >= 0) close(fd);
+      errno = err;
+      _tcp_throw("listen");
+    }
+    sockaddr_storage bound{};
+    socklen_t bound_size = sizeof(bound);
+    getsockname(fd, reinterpret_cast<sockaddr*>(&bound), &bound_size);
+    port = ntohs(bound.ss_family == AF_INET6 ? reinterpret_cast<sockaddr_in6&>(bound).sin6_port :
+                                              reinterpret_cast<sockaddr_in&>(bound).sin_port);
+    return fd;
+  }
+
+  // Blocking client for one connection, e.g. the transport of a caller:
+  //   prpc::tcp_client client("localhost", port);
+  //   prpc::caller cl([&client](string msg){ return client.sendrec(std::move(msg)); });
+  // Throws std::system_error when the connection fails.
+  class tcp_client{
+    int fd;
+    string in;
+    string out;
+
+    void write_all(std::string_view data){
+      while(!data.empty()){
+        ssize_t written = ::send(fd, data.data(), data.size(), MSG_NOSIGNAL);
+        if(written < 0){
+          if(errno == EINTR) continue;
+          _tcp_throw("send");
+        }
+        data.remove_prefix(written);
+      }
+    }
+    void read_some(){
+      char buf[65536];
+      ssize_t count;
+      while((count = ::recv(fd, buf, sizeof(buf), 0)) < 0 && errno == EINTR);
+      if(count < 0) _tcp_throw("recv");
+      if(count == 0) throw std::system_error(std::make_error_code(std::errc::connection_reset), "recv");
+      in.append(buf, count);
+    }
+    public:
+      tcp_client(string const &host, std::uint16_t port) : fd(_tcp_connect(host, port)) {}
+      tcp_client(tcp_client const &) = delete;
+      tcp_client &operator=(tcp_client const &) = delete;
+      ~tcp_client(){ close(fd); }
+
+      void send(std::string_view message){
+        out.clear();
+        _tcp_append_frame(out, message);
+        write_all(out);
+      }
+      // Blocks until a whole frame has arrived. Throws std::system_error for a frame longer
+      // than tcp_max_frame_size, after which the connection is out of step.
+      string receive(){
+        while(in.size() < 4) read_some();
+        std::size_t size = _tcp_frame_size(in.data());
+        if(size > tcp_max_frame_size) throw std::system_error(std::make_error_code(std::errc::message_size), "recv");
+        while(in.size() - 4 < size) read_some();
+        string message = in.substr(4, size);
+        in.erase(0, 4 + size);
+        return message;
+      }
+      string sendrec(string message){
+        send(message);
+        return receive();
+      }
+  };
+
+  // Non-blocking TCP transport for many connections on one thread. listen accepts
+  // connections and connect opens them, each gets a transport_send_f for sending to the
+  // other end, and run delivers the messages received on each connection. E.g. a server
+  // whose connections share one invoker:
+  //   prpc::invoker srv(nullptr);
+  //   srv.add("add_one", add_one);
+  //   prpc::tcp_loop loop;
+  //   loop.listen(7000, [&srv](prpc::transport_send_f send){
+  //     return [&srv, send = std::move(send)](string msg){ srv.invoke(std::move(msg), send); };
+  //   });
+  //   loop.run();
+  // Messages sent while run handles a batch of reads are written together once the
+  // batch is done, so the responses to pipelined calls share a write.
+  class tcp_loop{
+    public:
+      // Receives each message of a connection
+      typedef function<void(string)> message_f;
+      // Called with the send function of a new connection, returns its receiver
+      typedef function<message_f(transport_send_f)> accept_f;
+    private:
+      struct socket_t{
+        int fd;
+        // Set for a listening socket
+        accept_f on_accept;
+        message_f on_message;
+        // Bytes of incomplete frames
+        string in;
+        // Only touched by run
+        bool want_write = false;
+        bool closed = false;
+
+        std::mutex out_mutex;
+        // Frames waiting to be written
+        string out;
+        // Listed in flush_list
+        bool flush_queued = false;
+      };
+      int epoll_fd;
+      int wake_fd;
+      std::atomic<bool> stopping{false};
+      std::atomic<std::thread::id> run_thread;
+      // Owns the sockets, epoll events point to them
+      std::mutex sockets_mutex;
+      std::unordered_map<int, std::shared_ptr<socket_t>> sockets;
+      std::mutex flush_mutex;
+      std::vector<std::shared_ptr<socket_t>> flush_list;
+
+      void add_socket(std::shared_ptr<socket_t> sock, std::uint32_t events){
+        epoll_event event{};
+        event.events = events;
+        event.data.ptr = sock.get();
+        {
+          std::lock_guard<std::mutex> lock(sockets_mutex);
+          sockets[sock->fd] = sock;
+        }
+        if(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, sock->fd, &event) != 0){
+          std::lock_guard<std::mutex> lock(sockets_mutex);
+          sockets.erase(sock->fd);
+          _tcp_throw("epoll_ctl");
+        }
+      }
+      void close_socket(socket_t &sock){
+        if(sock.closed) return;
+        sock.closed = true;
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, sock.fd, nullptr);
+        {
+          // Before close, which lets connect reuse the descriptor
+          std::lock_guard<std::mutex> lock(sockets_mutex);
+          sockets.erase(sock.fd);
+        }
+        close(sock.fd);
+      }
+      std::shared_ptr<socket_t> add_connection(int fd, message_f on_message){
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        auto sock = std::make_shared<socket_t>();
+        sock->fd = fd;
+        sock->on_message = std::move(on_message);
+        return sock;
+      }
+      transport_send_f send_fun(std::weak_ptr<socket_t> weak_sock){
+        return [this, weak_sock](string message){
+          auto sock = weak_sock.lock();
+          if(!sock) return;
+          {
+            std::lock_guard<std::mutex> lock(sock->out_mutex);
+            _tcp_append_frame(sock->out, message);
+            if(sock->flush_queued) return;
+            sock->flush_queued = true;
+          }
+          {
+            std::lock_guard<std::mutex> lock(flush_mutex);
+            flush_list.push_back(std::move(sock));
+          }
+          if(std::this_thread::get_id() != run_thread.load()) wake();
+        };
+      }
+      void wake(){
+        std::uint64_t one = 1;
+        [[maybe_unused]] auto ignored = write(wake_fd, &one, sizeof(one));
+      }
+      void accept_all(socket_t &listener){
+        for(;;){
+          int fd = accept4(listener.fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+          if(fd < 0){
+            if(errno == EINTR || errno == ECONNABORTED) continue;
+            // EAGAIN once there are none left. Out of descriptors, the rest wait.
+            return;
+          }
+          auto sock = add_connection(fd, nullptr);
+          try{
+            sock->on_message = listener.on_accept(send_fun(sock));
+            add_socket(sock, EPOLLIN | EPOLLRDHUP);
+          }catch(...){
+            close(fd);
+          }
+        }
+      }
+      void read_all(socket_t &sock){
+        char buf[65536];
+        for(;;){
+          ssize_t count = ::recv(sock.fd, buf, sizeof(buf), 0);
+          if(count < 0){
+            if(errno == EINTR) continue;
+            if(errno != EAGAIN && errno != EWOULDBLOCK) close_socket(sock);
+            break;
+          }
+          if(count == 0){
+            close_socket(sock);
+            break;
+          }
+          sock.in.append(buf, count);
+          // After every read, so in holds at most one frame of up to tcp_max_frame_size
+          if(!_tcp_read_frames(sock.in, sock.on_message)){
+            close_socket(sock);
+            break;
+          }
+          if(sock.closed || std::size_t(count) < sizeof(buf)) break;
+        }
+      }
+      // Writes what the socket can take, and waits for EPOLLOUT if that isn't everything
+      void flush(socket_t &sock){
+        if(sock.closed) return;
+        std::unique_lock<std::mutex> lock(sock.out_mutex);
+        sock.flush_queued = false;
+        std::size_t done = 0;
+        while(done < sock.out.size()){
+          ssize_t written = ::send(sock.fd, sock.out.data() + done, sock.out.size() - done, MSG_NOSIGNAL);
+          if(written < 0){
+            if(errno == EINTR) continue;
+            if(errno == EAGAIN || errno == EWOULDBLOCK) break;
+            lock.unlock();
+            close_socket(sock);
+            return;
+          }
+          done += written;
+        }
+        sock.out.erase(0, done);
+        bool want_write = !sock.out.empty();
+        lock.unlock();
+        if(want_write != sock.want_write){
+          sock.want_write = want_write;
+          epoll_event event{};
+          event.events = EPOLLIN | EPOLLRDHUP | (want_write ? std::uint32_t(EPOLLOUT) : 0u);
+          event.data.ptr = &sock;
+          epoll_ctl(epoll_fd, EPOLL_CTL_MOD, sock.fd, &event);
+        }
+      }
+      void flush_queued(){
+        std::vector<std::shared_ptr<socket_t>> queued;
+        {
+          std::lock_guard<std::mutex> lock(flush_mutex);
+          queued.swap(flush_list);
+        }
+        for(auto &sock : queued) flush(*sock);
+      }
+    public:
+      tcp_loop(){
+        epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        if(epoll_fd < 0) _tcp_throw("epoll_create1");
+        wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if(wake_fd < 0){
+          close(epoll_fd);
+          _tcp_throw("eventfd");
+        }
+        epoll_event event{};
+        event.events = EPOLLIN;
+        event.data.ptr = nullptr;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_fd, &event);
+      }
+      tcp_loop(tcp_loop const &) = delete;
+      tcp_loop &operator=(tcp_loop const &) = delete;
+      ~tcp_loop(){
+        for(auto &sock : sockets) close(sock.first);
+        close(wake_fd);
+        close(epoll_fd);
+      }
+
+      // Accepts connections on address:port, port 0 picks a free one. Returns the port.
+      std::uint16_t listen(std::uint16_t port, accept_f on_accept, string const &address = "127.0.0.1"){
+        auto listener = std::make_shared<socket_t>();
+        listener->fd = _tcp_listen(address, port);
+        listener->on_accept = std::move(on_accept);
+        add_socket(listener, EPOLLIN);
+        return port;
+      }
+      // Opens a connection to host:port whose messages run passes to on_message. Returns
+      // the function that sends to it, e.g. for an async_caller. Blocks until connected.
+      transport_send_f connect(string const &host, std::uint16_t port, message_f on_message){
+        int fd = _tcp_connect(host, port);
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        auto sock = add_connection(fd, std::move(on_message));
+        auto send = send_fun(sock);
+        add_socket(std::move(sock), EPOLLIN | EPOLLRDHUP);
+        return send;
+      }
+      // Runs until stop, on one thread. The receivers are called on it. listen and
+      // connect can be called before it starts or from any thread while it runs, and the
+      // send functions from any thread.
+      void run(){
+        run_thread.store(std::this_thread::get_id());
+        std::array<epoll_event, 256> events;
+        while(!stopping.load()){
+          int count = epoll_wait(epoll_fd, events.data(), events.size(), -1);
+          if(count < 0){
+            if(errno == EINTR) continue;
+            _tcp_throw("epoll_wait");
+          }
+          // A socket closed by an earlier event of this batch stays alive until the end of it
+          std::vector<std::shared_ptr<socket_t>> batch;
+          {
+            std::lock_guard<std::mutex> lock(sockets_mutex);
+            for(int i = 0; i < count; i++){
+              auto sock = static_cast<socket_t*>(events[i].data.ptr);
+              auto it = sock ? sockets.find(sock->fd) : sockets.end();
+              batch.push_back(it != sockets.end() && it->second.get() == sock ? it->second : nullptr);
+            }
+          }
+          for(int i = 0; i < count; i++){
+            if(!events[i].data.ptr){
+              std::uint64_t wakes;
+              [[maybe_unused]] auto ignored = read(wake_fd, &wakes, sizeof(wakes));
+              continue;
+            }
+            auto &sock = batch[i];
+            if(!sock || sock->closed) continue;
+            if(sock->on_accept){
+              accept_all(*sock);
+              continue;
+            }
+            if(events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) read_all(*sock);
+            if(events[i].events & EPOLLOUT) flush(*sock);
+          }
+          flush_queued();
+        }
+        run_thread.store({});
+      }
+      // Makes run return, can be called from any thread
+      void stop(){
+        stopping.store(true);
+        wake();
+      }
+      // Open connections, not counting listening sockets
+      std::size_t connections(){
+        std::lock_guard<std::mutex> lock(sockets_mutex);
+        return std::count_if(sockets.begin(), sockets.end(), [](auto &sock){ return !sock.second->on_accept; });
+      }
+  };
+}
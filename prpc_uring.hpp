@@ -0,0 +1,454 @@
+// Copyright (C) 2021 Stuart Duncan
+//
+// This file is part of picoRPC.
+//
+// picoRPC is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// picoRPC is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with picoRPC.  If not, see <http://www.gnu.org/licenses/>.
+
+#pragma once
+
+// Optional io_uring TCP transport for Linux, with the frames and interface of tcp_loop
+// from prpc_tcp.hpp. It talks to the kernel through the raw system calls, so it doesn't
+// need liburing.
+
+#include "prpc_tcp.hpp"
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+namespace prpc{
+  // tcp_loop driven by io_uring: listening sockets have a multishot accept armed and
+  // connections a multishot receive, which takes its buffers from a ring of buffers
+  // registered with the kernel, so a busy loop gets a batch of messages per system call.
+  // The sends of a batch go in with the next wait, one per connection. Where io_uring
+  // isn't available (kernels before 5.19, or blocked by a sandbox) it runs a tcp_loop
+  // instead, uses_io_uring tells which.
+  class uring_loop{
+    public:
+      typedef tcp_loop::message_f message_f;
+      typedef tcp_loop::accept_f accept_f;
+    private:
+      static constexpr unsigned ring_entries = 1024;
+      static constexpr unsigned recv_buffer_count = 256;
+      static constexpr unsigned recv_buffer_size = 16384;
+      static constexpr std::uint16_t recv_buffer_group = 0;
+      // In the low bits of an operation's user_data, the rest is its socket_t
+      enum op_t : std::uint64_t{ op_wake = 0, op_accept = 1, op_recv = 2, op_send = 3 };
+      static constexpr std::uint64_t op_mask = 3;
+
+      struct socket_t : std::enable_shared_from_this<socket_t>{
+        int fd;
+        // Set for a listening socket
+        accept_f on_accept;
+        message_f on_message;
+        // Only touched by run
+        string in;
+        bool closed = false;
+        // An accept or receive is armed
+        bool receiving = false;
+        bool sending = false;
+        // Bytes of the send in flight
+        string sent;
+        std::size_t sent_done = 0;
+
+        std::mutex out_mutex;
+        // Frames waiting for the send in flight
+        string out;
+        // Listed in flush_list
+        bool flush_queued = false;
+      };
+
+      static_assert(alignof(socket_t) > op_mask);
+
+      std::unique_ptr<tcp_loop> fallback;
+      int ring_fd = -1;
+      // Submission and completion queues, shared with the kernel
+      void *rings = MAP_FAILED;
+      std::size_t rings_size = 0;
+      io_uring_sqe *sqes = static_cast<io_uring_sqe*>(MAP_FAILED);
+      std::size_t sqes_size = 0;
+      unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+      unsigned sq_entries = 0;
+      unsigned *cq_head, *cq_tail, *cq_mask;
+      io_uring_cqe *cqes;
+      // Completions taken off the queue early to make room for submissions, handled first
+      // by the next reap
+      std::deque<io_uring_cqe> deferred;
+      unsigned sq_local_tail = 0;
+      unsigned to_submit = 0;
+      bool multishot_recv = true;
+      // The ring of free receive buffers. This is io_uring_buf_ring, whose bufs member
+      // doesn't start at offset 0 in C++ because of how the header declares it.
+      io_uring_buf *buf_ring = static_cast<io_uring_buf*>(MAP_FAILED);
+      std::size_t buf_ring_size = 0;
+      std::uint16_t buf_tail = 0;
+      std::unique_ptr<char[]> recv_buffers;
+
+      int wake_fd = -1;
+      std::uint64_t wake_count = 0;
+      std::atomic<bool> stopping{false};
+      std::atomic<std::thread::id> run_thread;
+      std::mutex sockets_mutex;
+      // Owns the sockets. Closed ones stay until their operations have completed.
+      std::unordered_map<int, std::shared_ptr<socket_t>> sockets;
+      // Added by listen and connect, waiting for run to arm them
+      std::vector<std::shared_ptr<socket_t>> to_arm;
+      std::mutex flush_mutex;
+      std::vector<std::shared_ptr<socket_t>> flush_list;
+
+      bool setup(){
+        io_uring_params params{};
+        params.flags = IORING_SETUP_CQSIZE;
+        params.cq_entries = ring_entries * 4;
+        ring_fd = syscall(__NR_io_uring_setup, ring_entries, &params);
+        if(ring_fd < 0) return false;
+        if(!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_NODROP)) return false;
+
+        rings_size = std::max(params.sq_off.array + params.sq_entries * sizeof(unsigned),
+                              params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe));
+        rings = mmap(nullptr, rings_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+        if(rings == MAP_FAILED) return false;
+        sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+        sqes = static_cast<io_uring_sqe*>(mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                               ring_fd, IORING_OFF_SQES));
+        if(sqes == MAP_FAILED) return false;
+        auto ring_field = [this](std::uint32_t offset){ return reinterpret_cast<unsigned*>(static_cast<char*>(rings) + offset); };
+        sq_head = ring_field(params.sq_off.head);
+        sq_tail = ring_field(params.sq_off.tail);
+        sq_mask = ring_field(params.sq_off.ring_mask);
+        sq_array = ring_field(params.sq_off.array);
+        sq_entries = params.sq_entries;
+        sq_local_tail = *sq_tail;
+        cq_head = ring_field(params.cq_off.head);
+        cq_tail = ring_field(params.cq_off.tail);
+        cq_mask = ring_field(params.cq_off.ring_mask);
+        cqes = reinterpret_cast<io_uring_cqe*>(ring_field(params.cq_off.cqes));
+
+        buf_ring_size = recv_buffer_count * sizeof(io_uring_buf);
+        buf_ring = static_cast<io_uring_buf*>(mmap(nullptr, buf_ring_size, PROT_READ | PROT_WRITE,
+                                                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+        if(buf_ring == MAP_FAILED) return false;
+        io_uring_buf_reg reg{};
+        reg.ring_addr = reinterpret_cast<std::uint64_t>(buf_ring);
+        reg.ring_entries = recv_buffer_count;
+        reg.bgid = recv_buffer_group;
+        if(syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0) return false;
+        recv_buffers.reset(new char[std::size_t(recv_buffer_count) * recv_buffer_size]);
+        for(std::uint16_t bid = 0; bid < recv_buffer_count; bid++) return_buffer(bid);
+
+        wake_fd = eventfd(0, EFD_CLOEXEC);
+        return wake_fd >= 0;
+      }
+      void teardown(){
+        if(ring_fd >= 0) close(ring_fd);
+        if(rings != MAP_FAILED) munmap(rings, rings_size);
+        if(sqes != MAP_FAILED) munmap(sqes, sqes_size);
+        if(buf_ring != MAP_FAILED) munmap(buf_ring, buf_ring_size);
+        if(wake_fd >= 0) close(wake_fd);
+        ring_fd = wake_fd = -1;
+        rings = MAP_FAILED;
+        sqes = static_cast<io_uring_sqe*>(MAP_FAILED);
+        buf_ring = static_cast<io_uring_buf*>(MAP_FAILED);
+      }
+
+      // Never hands out an entry the kernel hasn't consumed yet. While the queue is full it
+      // submits, and if the kernel wants completions reaped first it defers them.
+      io_uring_sqe *get_sqe(){
+        while(sq_local_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) == sq_entries){
+          if(!submit(0)) defer_completions();
+        }
+        unsigned index = sq_local_tail & *sq_mask;
+        io_uring_sqe *sqe = &sqes[index];
+        std::memset(sqe, 0, sizeof(*sqe));
+        sq_array[index] = index;
+        sq_local_tail++;
+        to_submit++;
+        return sqe;
+      }
+      // Hands the kernel the queued operations, and waits for wait_for completions. Returns
+      // false if the kernel needs completions reaped before it takes more.
+      bool submit(unsigned wait_for){
+        __atomic_store_n(sq_tail, sq_local_tail, __ATOMIC_RELEASE);
+        int done = syscall(__NR_io_uring_enter, ring_fd, to_submit, wait_for, wait_for ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+        if(done >= 0){
+          to_submit -= done;
+          return true;
+        }
+        if(errno == EBUSY || errno == EAGAIN) return false;
+        if(errno != EINTR) _tcp_throw("io_uring_enter");
+        return true;
+      }
+      void defer_completions(){
+        // Moves completions the kernel holds back into the queue
+        syscall(__NR_io_uring_enter, ring_fd, 0, 0, IORING_ENTER_GETEVENTS, nullptr, 0);
+        unsigned head = *cq_head;
+        unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+        for(; head != tail; head++) deferred.push_back(cqes[head & *cq_mask]);
+        __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+      }
+      static std::uint64_t user_data(socket_t &sock, op_t op){ return reinterpret_cast<std::uint64_t>(&sock) | op; }
+
+      void return_buffer(std::uint16_t bid){
+        io_uring_buf &buf = buf_ring[buf_tail & (recv_buffer_count - 1)];
+        // One field at a time, the first buffer's resv is the ring's tail
+        buf.addr = reinterpret_cast<std::uint64_t>(recv_buffers.get() + std::size_t(bid) * recv_buffer_size);
+        buf.len = recv_buffer_size;
+        buf.bid = bid;
+        buf_tail++;
+        __atomic_store_n(&buf_ring[0].resv, buf_tail, __ATOMIC_RELEASE);
+      }
+      void arm_wake(){
+        io_uring_sqe *sqe = get_sqe();
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd = wake_fd;
+        sqe->addr = reinterpret_cast<std::uint64_t>(&wake_count);
+        sqe->len = sizeof(wake_count);
+        sqe->user_data = op_wake;
+      }
+      void arm_accept(socket_t &sock){
+        io_uring_sqe *sqe = get_sqe();
+        sqe->opcode = IORING_OP_ACCEPT;
+        sqe->fd = sock.fd;
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+        sqe->accept_flags = SOCK_CLOEXEC;
+        sqe->user_data = user_data(sock, op_accept);
+        sock.receiving = true;
+      }
+      void arm_recv(socket_t &sock){
+        io_uring_sqe *sqe = get_sqe();
+        sqe->opcode = IORING_OP_RECV;
+        sqe->fd = sock.fd;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = recv_buffer_group;
+        if(multishot_recv) sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->user_data = user_data(sock, op_recv);
+        sock.receiving = true;
+      }
+      void send_more(socket_t &sock){
+        io_uring_sqe *sqe = get_sqe();
+        sqe->opcode = IORING_OP_SEND;
+        sqe->fd = sock.fd;
+        sqe->addr = reinterpret_cast<std::uint64_t>(sock.sent.data() + sock.sent_done);
+        sqe->len = sock.sent.size() - sock.sent_done;
+        sqe->msg_flags = MSG_NOSIGNAL;
+        sqe->user_data = user_data(sock, op_send);
+        sock.sending = true;
+      }
+      // Starts sending the frames queued for sock, unless a send is in flight already
+      void flush(socket_t &sock){
+        {
+          std::lock_guard<std::mutex> lock(sock.out_mutex);
+          sock.flush_queued = false;
+          if(sock.closed || sock.sending || sock.out.empty()) return;
+          sock.sent.clear();
+          sock.sent.swap(sock.out);
+        }
+        sock.sent_done = 0;
+        send_more(sock);
+      }
+      void close_socket(socket_t &sock){
+        if(sock.closed) return;
+        sock.closed = true;
+        // Ends the armed receive
+        shutdown(sock.fd, SHUT_RDWR);
+        release_if_idle(sock);
+      }
+      // Frees a closed socket once none of its operations are in flight. sock can't be
+      // used after this.
+      void release_if_idle(socket_t &sock){
+        if(!sock.closed || sock.receiving || sock.sending) return;
+        int fd = sock.fd;
+        {
+          // Before close, which lets connect and accept reuse the descriptor
+          std::lock_guard<std::mutex> lock(sockets_mutex);
+          sockets.erase(fd);
+        }
+        close(fd);
+      }
+      transport_send_f send_fun(std::weak_ptr<socket_t> weak_sock){
+        return [this, weak_sock](string message){
+          auto sock = weak_sock.lock();
+          if(!sock) return;
+          {
+            std::lock_guard<std::mutex> lock(sock->out_mutex);
+            _tcp_append_frame(sock->out, message);
+            if(sock->flush_queued) return;
+            sock->flush_queued = true;
+          }
+          {
+            std::lock_guard<std::mutex> lock(flush_mutex);
+            flush_list.push_back(std::move(sock));
+          }
+          if(std::this_thread::get_id() != run_thread.load()) wake();
+        };
+      }
+      void wake(){
+        std::uint64_t one = 1;
+        [[maybe_unused]] auto ignored = write(wake_fd, &one, sizeof(one));
+      }
+      void add_socket(std::shared_ptr<socket_t> sock){
+        std::lock_guard<std::mutex> lock(sockets_mutex);
+        sockets[sock->fd] = sock;
+        to_arm.push_back(std::move(sock));
+      }
+
+      void on_accepted(socket_t &listener, io_uring_cqe const &cqe){
+        if(cqe.res >= 0){
+          int one = 1;
+          setsockopt(cqe.res, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+          auto sock = std::make_shared<socket_t>();
+          sock->fd = cqe.res;
+          try{
+            sock->on_message = listener.on_accept(send_fun(sock));
+            std::lock_guard<std::mutex> lock(sockets_mutex);
+            sockets[sock->fd] = sock;
+          }catch(...){
+            close(sock->fd);
+            sock = nullptr;
+          }
+          if(sock) arm_recv(*sock);
+        }
+        if(!(cqe.flags & IORING_CQE_F_MORE)){
+          listener.receiving = false;
+          if(!listener.closed) arm_accept(listener);
+        }
+      }
+      void on_received(socket_t &sock, io_uring_cqe const &cqe){
+        bool more = cqe.flags & IORING_CQE_F_MORE;
+        if(cqe.res > 0 && (cqe.flags & IORING_CQE_F_BUFFER)){
+          auto bid = static_cast<std::uint16_t>(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+          if(!sock.closed) sock.in.append(recv_buffers.get() + std::size_t(bid) * recv_buffer_size, cqe.res);
+          return_buffer(bid);
+          if(!sock.closed && !_tcp_read_frames(sock.in, sock.on_message)) close_socket(sock);
+        }else if(cqe.res == -EINVAL && multishot_recv){
+          // Kernels before 6.0 take one buffer per receive
+          multishot_recv = false;
+        }else if(cqe.res != -ENOBUFS){
+          close_socket(sock);
+        }
+        if(!more){
+          sock.receiving = false;
+          if(sock.closed) release_if_idle(sock);
+          else arm_recv(sock);
+        }
+      }
+      void on_sent(socket_t &sock, io_uring_cqe const &cqe){
+        sock.sending = false;
+        if(cqe.res < 0) close_socket(sock);
+        if(sock.closed){
+          release_if_idle(sock);
+          return;
+        }
+        sock.sent_done += cqe.res;
+        if(sock.sent_done < sock.sent.size()) send_more(sock);
+        else flush(sock);
+      }
+      // Handles the completions there are now. Handling one can defer others, so the head
+      // is read again each time.
+      void reap(){
+        std::size_t count = deferred.size() + (__atomic_load_n(cq_tail, __ATOMIC_ACQUIRE) - *cq_head);
+        for(; count != 0; count--){
+          io_uring_cqe cqe;
+          if(!deferred.empty()){
+            cqe = deferred.front();
+            deferred.pop_front();
+          }else{
+            unsigned head = *cq_head;
+            if(head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) break;
+            cqe = cqes[head & *cq_mask];
+            __atomic_store_n(cq_head, head + 1, __ATOMIC_RELEASE);
+          }
+          auto op = static_cast<op_t>(cqe.user_data & op_mask);
+          if(op == op_wake){
+            arm_wake();
+            continue;
+          }
+          // Keeps the socket alive while its completion is handled
+          auto sock = reinterpret_cast<socket_t*>(cqe.user_data & ~op_mask)->shared_from_this();
+          if(op == op_accept) on_accepted(*sock, cqe);
+          else if(op == op_recv) on_received(*sock, cqe);
+          else on_sent(*sock, cqe);
+        }
+      }
+    public:
+      // With try_io_uring false it is a tcp_loop from the start
+      explicit uring_loop(bool try_io_uring = true){
+        if(try_io_uring && setup()) return;
+        teardown();
+        fallback = std::make_unique<tcp_loop>();
+      }
+      uring_loop(uring_loop const &) = delete;
+      uring_loop &operator=(uring_loop const &) = delete;
+      ~uring_loop(){
+        // Closing the ring cancels what is in flight
+        teardown();
+        for(auto &sock : sockets) close(sock.first);
+      }
+      bool uses_io_uring() const {return !fallback; }
+
+      // The same as tcp_loop's
+      std::uint16_t listen(std::uint16_t port, accept_f on_accept, string const &address = "127.0.0.1"){
+        if(fallback) return fallback->listen(port, std::move(on_accept), address);
+        auto listener = std::make_shared<socket_t>();
+        listener->fd = _tcp_listen(address, port);
+        listener->on_accept = std::move(on_accept);
+        add_socket(std::move(listener));
+        wake();
+        return port;
+      }
+      transport_send_f connect(string const &host, std::uint16_t port, message_f on_message){
+        if(fallback) return fallback->connect(host, port, std::move(on_message));
+        auto sock = std::make_shared<socket_t>();
+        sock->fd = _tcp_connect(host, port);
+        sock->on_message = std::move(on_message);
+        auto send = send_fun(sock);
+        add_socket(std::move(sock));
+        wake();
+        return send;
+      }
+      void run(){
+        if(fallback) return fallback->run();
+        run_thread.store(std::this_thread::get_id());
+        arm_wake();
+        while(!stopping.load()){
+          std::vector<std::shared_ptr<socket_t>> armed, queued;
+          {
+            std::lock_guard<std::mutex> lock(sockets_mutex);
+            armed.swap(to_arm);
+          }
+          for(auto &sock : armed){
+            if(sock->on_accept) arm_accept(*sock);
+            else arm_recv(*sock);
+          }
+          {
+            std::lock_guard<std::mutex> lock(flush_mutex);
+            queued.swap(flush_list);
+          }
+          for(auto &sock : queued) flush(*sock);
+          submit(deferred.empty() ? 1 : 0);
+          reap();
+        }
+        run_thread.store({});
+      }
+      void stop(){
+        if(fallback) return fallback->stop();
+        stopping.store(true);
+        wake();
+      }
+      std::size_t connections(){
+        if(fallback) return fallback->connections();
+        std::lock_guard<std::mutex> lock(sockets_mutex);
+        return std::count_if(sockets.begin(), sockets.end(), [](auto &sock){ return !sock.second->on_accept; });
+      }
+  };
+}
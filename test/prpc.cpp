@@ -17,7 +17,57 @@
 
 #include "catch.hpp"
 #include "prpc.hpp"
+#include "prpc_tcp.hpp"
+#include "prpc_shm.hpp"
+#include "prpc_uring.hpp"
 #include <iostream>
+#include <algorithm>
+#include <cstdlib>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <random>
+#include <locale>
+#include <cmath>
+#include <deque>
+#include <condition_variable>
+#include <new>
+#include <cstddef>
+
+// Counts heap allocations so tests can check that the zero-copy paths don't allocate.
+// Every form of new and delete is replaced, all on malloc and free, so memory from any
+// of them can be freed by any delete.
+std::atomic<std::size_t> allocation_count{0};
+void *counted_alloc(std::size_t size, std::size_t alignment = alignof(std::max_align_t)) noexcept {
+  allocation_count++;
+  if(size == 0) size = 1;
+  if(alignment <= alignof(std::max_align_t)) return std::malloc(size);
+  return std::aligned_alloc(alignment, (size + alignment - 1) / alignment * alignment);
+}
+void *counted_new(std::size_t size, std::size_t alignment = alignof(std::max_align_t)){
+  if(void *ptr = counted_alloc(size, alignment)) return ptr;
+  throw std::bad_alloc();
+}
+void *operator new(std::size_t size){ return counted_new(size); }
+void *operator new[](std::size_t size){ return counted_new(size); }
+void *operator new(std::size_t size, std::align_val_t align){ return counted_new(size, std::size_t(align)); }
+void *operator new[](std::size_t size, std::align_val_t align){ return counted_new(size, std::size_t(align)); }
+void *operator new(std::size_t size, std::nothrow_t const &) noexcept { return counted_alloc(size); }
+void *operator new[](std::size_t size, std::nothrow_t const &) noexcept { return counted_alloc(size); }
+void *operator new(std::size_t size, std::align_val_t align, std::nothrow_t const &) noexcept { return counted_alloc(size, std::size_t(align)); }
+void *operator new[](std::size_t size, std::align_val_t align, std::nothrow_t const &) noexcept { return counted_alloc(size, std::size_t(align)); }
+void operator delete(void *ptr) noexcept { std::free(ptr); }
+void operator delete[](void *ptr) noexcept { std::free(ptr); }
+void operator delete(void *ptr, std::size_t) noexcept { std::free(ptr); }
+void operator delete[](void *ptr, std::size_t) noexcept { std::free(ptr); }
+void operator delete(void *ptr, std::align_val_t) noexcept { std::free(ptr); }
+void operator delete[](void *ptr, std::align_val_t) noexcept { std::free(ptr); }
+void operator delete(void *ptr, std::size_t, std::align_val_t) noexcept { std::free(ptr); }
+void operator delete[](void *ptr, std::size_t, std::align_val_t) noexcept { std::free(ptr); }
+void operator delete(void *ptr, std::nothrow_t const &) noexcept { std::free(ptr); }
+void operator delete[](void *ptr, std::nothrow_t const &) noexcept { std::free(ptr); }
+void operator delete(void *ptr, std::align_val_t, std::nothrow_t const &) noexcept { std::free(ptr); }
+void operator delete[](void *ptr, std::align_val_t, std::nothrow_t const &) noexcept { std::free(ptr); }
 
 std::string tmp_response;
 void inv_dummy_send(string msg){
@@ -227,4 +277,1271 @@ TEST_CASE("Test caller with dummy transport", "[caller-invoker]"){
     getint_return = caller->call("get_int");
   }
 
-}
\ No newline at end of file
+}
+double half(double d){ return d / 2; }
+string echo(string s){ return s; }
+bool negate(bool b){ return !b; }
+
+TEST_CASE("Binary wire format invoker", "[invoker][binary]"){
+  tmp_response = "";
+  prpc::invoker srv(inv_dummy_send, prpc::wire_format::binary);
+  srv.add("add_one", add_one);
+
+  SECTION("Ints are fixed-width little-endian, strings are varint length prefixed"){
+    srv.invoke(string{"\x07" "add_one" "\x0a\x00\x00\x00", 12});
+    REQUIRE(tmp_response == string{"\x09" "PRPC_GOOD" "\x0b\x00\x00\x00", 14});
+  }
+
+  SECTION("Truncated and trailing bytes are rejected"){
+    srv.invoke(string{"\x07" "add_one" "\x0a\x00", 10});
+    REQUIRE(tmp_response == string{"\x1b" "PRPC_INV_ARG_EXTRACT_FAILED"});
+    srv.invoke(string{"\x07" "add_one" "\x0a\x00\x00\x00\x00", 13});
+    REQUIRE(tmp_response == string{"\x1b" "PRPC_INV_ARG_EXTRACT_FAILED"});
+  }
+
+  SECTION("Unknown and malformed function IDs are rejected"){
+    srv.invoke(string{"\x05" "bogus"});
+    REQUIRE(tmp_response == string{"\x14" "PRPC_INV_FUN_NOEXIST"});
+    srv.invoke(string{"\x7f" "add_one"});
+    REQUIRE(tmp_response == string{"\x14" "PRPC_INV_FUN_NOEXIST"});
+  }
+}
+
+TEST_CASE("Test binary caller with dummy transport", "[caller-invoker][binary]"){
+  invoke = new prpc::invoker(dummy_transport_invoke_send, prpc::wire_format::binary);
+  invoke->add("simple", simple);
+  invoke->add("add_one", add_one);
+  invoke->add("concat", concat);
+  invoke->add("half", half);
+  invoke->add("echo", echo);
+  invoke->add("negate", negate);
+  caller = new prpc::caller(dummy_transport_call_sendrec, prpc::wire_format::binary);
+
+  SECTION("Scalars round-trip"){
+    REQUIRE_NOTHROW(caller->call("simple"));
+    int return_addone = caller->call("add_one", -10);
+    REQUIRE(return_addone == -9);
+    double return_half = caller->call("half", 0.1);
+    REQUIRE(return_half == 0.05);
+    bool return_negate = caller->call("negate", false);
+    REQUIRE(return_negate);
+  }
+
+  SECTION("Strings are sent as raw bytes"){
+    string quotes_and_nulls{"\"quoted\" \\ \0 \xff", 15};
+    string return_echo = caller->call("echo", quotes_and_nulls);
+    REQUIRE(return_echo == quotes_and_nulls);
+    string return_concat = caller->call("concat", "spaces count in string: ", 4);
+    REQUIRE(return_concat == "spaces count in string: 4");
+  }
+
+  SECTION("Builtin functions work"){
+    string version = caller->call("prpc-get-version");
+    REQUIRE(version == PRPC_VERSION_STR);
+  }
+
+  SECTION("Bad function calls throw"){
+    REQUIRE_THROWS_AS(caller->call("bogus-fn"), prpc::UnknownFunctionException);
+    REQUIRE_THROWS_AS(caller->call("add_one", 1, 99), prpc::BadArgListException);
+    REQUIRE_THROWS_AS(caller->call("add_one", (double)0.1), prpc::BadArgListException);
+  }
+}
+
+TEST_CASE("Functions are assigned dense numeric IDs", "[invoker][fun-num]"){
+  tmp_response = "";
+  prpc::invoker srv(inv_dummy_send);
+  prpc::fun_num_t add_one_num = srv.add("add_one", add_one);
+  prpc::fun_num_t get_int_num = srv.add("get_int", get_int);
+  REQUIRE(get_int_num == add_one_num + 1);
+
+  SECTION("Invoking by numeric ID"){
+    srv.invoke("#" + std::to_string(add_one_num) + " 41");
+    REQUIRE(tmp_response == "PRPC_GOOD 42");
+    srv.invoke("#" + std::to_string(get_int_num));
+    REQUIRE(tmp_response == "PRPC_GOOD 42");
+  }
+
+  SECTION("Bad numeric IDs don't exist"){
+    srv.invoke("#" + std::to_string(get_int_num + 1));
+    REQUIRE(tmp_response == "PRPC_INV_FUN_NOEXIST");
+    srv.invoke("#1x");
+    REQUIRE(tmp_response == "PRPC_INV_FUN_NOEXIST");
+    srv.invoke("#");
+    REQUIRE(tmp_response == "PRPC_INV_FUN_NOEXIST");
+  }
+
+  SECTION("Function IDs that look like numeric IDs can't be added"){
+    REQUIRE_THROWS(srv.add("#9", get_int));
+    REQUIRE_THROWS(srv.add("", get_int));
+  }
+
+  SECTION("Numeric IDs are listed by prpc-get-next-function"){
+    srv.invoke("prpc-get-next-function");
+    REQUIRE(tmp_response == "PRPC_GOOD \"\\\"add_one  #" + std::to_string(add_one_num) + "\\\"\"");
+    srv.invoke("prpc-get-next-function");
+    REQUIRE(tmp_response == "PRPC_GOOD \"\\\"get_int  #" + std::to_string(get_int_num) + "\\\"\"");
+    srv.invoke("prpc-get-next-function");
+    REQUIRE(tmp_response == "PRPC_GOOD \"PRPC_FUNLIST_END\"");
+  }
+
+  SECTION("Binary numeric IDs are an empty string followed by a varint"){
+    prpc::invoker bin_srv(inv_dummy_send, prpc::wire_format::binary);
+    prpc::fun_num_t num = bin_srv.add("add_one", add_one);
+    bin_srv.invoke(string{"\x00", 1} + char(num) + string{"\x0a\x00\x00\x00", 4});
+    REQUIRE(tmp_response == string{"\x09" "PRPC_GOOD" "\x0b\x00\x00\x00", 14});
+  }
+}
+
+TEST_CASE("Caller uses cached numeric IDs", "[caller-invoker][fun-num]"){
+  for(auto format : {prpc::wire_format::text, prpc::wire_format::binary}){
+    invoke = new prpc::invoker(dummy_transport_invoke_send, format);
+    prpc::fun_num_t get_int_num = invoke->add("get_int", get_int);
+    prpc::fun_num_t add_one_num = invoke->add("add_one", add_one);
+    caller = new prpc::caller(dummy_transport_call_sendrec, format);
+
+    auto fun_nums = caller->fetch_fun_nums();
+    REQUIRE(fun_nums.size() == 2);
+    REQUIRE(fun_nums.at("get_int") == get_int_num);
+    REQUIRE(fun_nums.at("add_one") == add_one_num);
+
+    int return_getint = caller->call("get_int");
+    REQUIRE(return_getint == 42);
+    int return_addone = caller->call("add_one", 10);
+    REQUIRE(return_addone == 11);
+    return_addone = caller->call(add_one_num, 20);
+    REQUIRE(return_addone == 21);
+    REQUIRE_THROWS_AS(caller->call(add_one_num + 1), prpc::UnknownFunctionException);
+  }
+}
+
+TEST_CASE("prpc-list-functions returns the whole table in one call", "[caller-invoker][fun-num]"){
+  for(auto format : {prpc::wire_format::text, prpc::wire_format::binary}){
+    prpc::invoker srv(inv_dummy_send, format);
+    for(int i = 0; i < 10000; i++) srv.add("f" + std::to_string(i), get_int);
+    std::size_t round_trips = 0, response_bytes = 0;
+    prpc::caller cl([&](std::string_view msg, string &resp){
+      round_trips++;
+      srv.invoke(msg, resp);
+      response_bytes = resp.size();
+    }, format);
+
+    auto fun_nums = cl.fetch_fun_nums();
+    REQUIRE(round_trips == 1);
+    REQUIRE(fun_nums.size() == 10000);
+    REQUIRE(fun_nums.count("prpc-list-functions") == 0);
+    REQUIRE(cl.call("f9999").as<int>() == 42);
+
+    // An unchanged table isn't sent again
+    auto [hash, rows] = cl.call("prpc-list-functions", std::uint64_t(0))
+                          .as<std::pair<std::uint64_t, std::vector<prpc::function_row>>>();
+    REQUIRE(rows.size() == 10000);
+    REQUIRE(std::get<1>(rows[0]).empty());
+    REQUIRE(fun_nums.at(std::get<0>(rows[0])) == std::get<2>(rows[0]));
+    round_trips = 0;
+    REQUIRE(cl.fetch_fun_nums().size() == 10000);
+    REQUIRE(round_trips == 1);
+    REQUIRE(response_bytes < 64);
+
+    prpc::fun_num_t added = srv.add("added", add_one);
+    REQUIRE(cl.fetch_fun_nums().at("added") == added);
+    srv.remove("added");
+    REQUIRE(cl.fetch_fun_nums().count("added") == 0);
+    // The same functions under the same numeric IDs hash the same again
+    auto unchanged = cl.call("prpc-list-functions", hash).as<std::pair<std::uint64_t, std::vector<prpc::function_row>>>();
+    REQUIRE(unchanged.first == hash);
+    REQUIRE(unchanged.second.empty());
+  }
+}
+
+std::size_t count_a(std::string_view s){ return std::count(s.begin(), s.end(), 'a'); }
+std::string_view first_word(std::string_view s){ return s.substr(0, s.find(' ')); }
+
+TEST_CASE("string_view args point into the message", "[invoker][zero-copy]"){
+  string response;
+  prpc::invoker srv(inv_dummy_send);
+  srv.add("count_a", count_a);
+  srv.add("first_word", first_word);
+
+  SECTION("Unquoted, quoted and escaped strings"){
+    srv.invoke("count_a banana", response);
+    REQUIRE(response == "PRPC_GOOD 3");
+    srv.invoke("count_a \"aa b a\"", response);
+    REQUIRE(response == "PRPC_GOOD 3");
+    srv.invoke("first_word \"a \\\"quoted\\\" string\"", response);
+    REQUIRE(response == "PRPC_GOOD \"a\"");
+    srv.invoke("first_word \"\\\"quoted\\\" string\"", response);
+    REQUIRE(response == "PRPC_GOOD \"\\\"quoted\\\"\"");
+  }
+
+  SECTION("Missing and unterminated strings fail"){
+    srv.invoke("count_a", response);
+    REQUIRE(response == "PRPC_INV_ARG_EXTRACT_FAILED");
+    srv.invoke("count_a \"aaa", response);
+    REQUIRE(response == "PRPC_INV_ARG_EXTRACT_FAILED");
+    srv.invoke("count_a \"a\\\"aa", response);
+    REQUIRE(response == "PRPC_INV_ARG_EXTRACT_FAILED");
+  }
+}
+
+TEST_CASE("Zero-copy invoke and call don't allocate", "[caller-invoker][zero-copy]"){
+  for(auto format : {prpc::wire_format::text, prpc::wire_format::binary}){
+    prpc::invoker srv(inv_dummy_send, format);
+    srv.add("count_a", count_a);
+    prpc::caller cl([&srv](std::string_view msg, string &resp){ srv.invoke(msg, resp); }, format);
+    string payload(1024, 'a');
+
+    std::size_t count = cl.call("count_a", std::string_view(payload));
+    REQUIRE(count == 1024);
+
+    std::size_t allocations_before = allocation_count;
+    count = cl.call("count_a", std::string_view(payload));
+    auto allocations = allocation_count - allocations_before;
+    REQUIRE(allocations == 0);
+    REQUIRE(count == 1024);
+
+    string request, response;
+    prpc::caller request_writer([&request](std::string_view msg, string &){ request = msg; }, format);
+    REQUIRE_THROWS(request_writer.call("count_a", std::string_view(payload)));
+    count = cl.call_serial(request, response);
+    REQUIRE(count == 1024);
+  }
+}
+
+TEST_CASE("serial_buffer is reused between calls", "[serial-buffer]"){
+  prpc::serial_buffer buf;
+  std::ostream strm(&buf);
+  strm << "PRPC_GOOD " << 42;
+  REQUIRE(buf.view() == "PRPC_GOOD 42");
+
+  string big(1000, 'x');
+  strm.write(big.data(), big.size());
+  REQUIRE(buf.size() == 1012);
+  REQUIRE(buf.view().substr(12) == big);
+  auto capacity = buf.capacity();
+
+  buf.reset();
+  REQUIRE(buf.size() == 0);
+  REQUIRE(buf.capacity() == capacity);
+  strm << "again";
+  REQUIRE(buf.view() == "again");
+}
+
+TEST_CASE("Invoker and caller reuse arena-backed serial buffers", "[caller-invoker][serial-buffer]"){
+  char request_arena[4096], response_arena[4096];
+  std::pmr::monotonic_buffer_resource request_resource(request_arena, sizeof(request_arena), std::pmr::null_memory_resource());
+  std::pmr::monotonic_buffer_resource response_resource(response_arena, sizeof(response_arena), std::pmr::null_memory_resource());
+
+  prpc::invoker srv(inv_dummy_send, prpc::wire_format::binary, &response_resource);
+  srv.add("count_a", count_a);
+  prpc::serial_buffer response(&response_resource);
+  prpc::caller cl([&srv, &response](std::string_view msg, string &resp){
+    srv.invoke(msg, response);
+    resp.assign(response.data(), response.size());
+  }, prpc::wire_format::binary, &request_resource);
+  string payload(1024, 'a');
+
+  // The arenas can't fall back to the heap, so this only works if the buffers are reused
+  for(int i = 0; i < 100; i++){
+    std::size_t count = cl.call("count_a", std::string_view(payload));
+    REQUIRE(count == 1024);
+  }
+}
+
+TEST_CASE("Correlation IDs are echoed in the response", "[invoker][async]"){
+  tmp_response = "";
+  prpc::invoker srv(inv_dummy_send);
+  srv.add("add_one", add_one);
+
+  srv.invoke("@7 add_one 1");
+  REQUIRE(tmp_response == "@7 PRPC_GOOD 2");
+  srv.invoke("@8 bogus-fun");
+  REQUIRE(tmp_response == "@8 PRPC_INV_FUN_NOEXIST");
+  srv.invoke("@9 add_one x");
+  REQUIRE(tmp_response == "@9 PRPC_INV_ARG_EXTRACT_FAILED");
+  REQUIRE_THROWS(srv.add("@add", add_one));
+
+  prpc::invoker bin_srv(inv_dummy_send, prpc::wire_format::binary);
+  bin_srv.add("add_one", add_one);
+  bin_srv.invoke(string{"\x01@\x07\x07" "add_one" "\x01\x00\x00\x00", 15});
+  REQUIRE(tmp_response == string{"\x01@\x07\x09" "PRPC_GOOD" "\x02\x00\x00\x00", 17});
+}
+
+TEST_CASE("Async caller matches out of order responses", "[caller-invoker][async]"){
+  for(auto format : {prpc::wire_format::text, prpc::wire_format::binary}){
+    std::vector<string> responses;
+    prpc::invoker srv([&responses](string msg){ responses.push_back(msg); }, format);
+    srv.add("add_one", add_one);
+    srv.add("concat", concat);
+    prpc::async_caller cl([&srv](string msg){ srv.invoke(msg); }, format);
+
+    auto first = cl.call_async("add_one", 1);
+    auto second = cl.call_async("concat", "count: ", 2);
+    auto third = cl.call_async("bogus-fn");
+    REQUIRE(cl.in_flight() == 3);
+    REQUIRE(responses.size() == 3);
+
+    for(auto it = responses.rbegin(); it != responses.rend(); it++) REQUIRE(cl.receive(*it));
+    REQUIRE(cl.in_flight() == 0);
+    REQUIRE_FALSE(cl.receive(responses[0]));
+
+    int return_addone = first.get();
+    REQUIRE(return_addone == 2);
+    string return_concat = second.get();
+    REQUIRE(return_concat == "count: 2");
+    REQUIRE_THROWS_AS(third.get(), prpc::UnknownFunctionException);
+  }
+}
+
+TEST_CASE("One invoker answers each connection through its own reply", "[invoker][connections]"){
+  // Streamed calls reply from the invoker's stream threads, which it joins when destroyed
+  std::mutex responses_mutex;
+  std::condition_variable responses_cv;
+  std::vector<string> first_responses, second_responses;
+  auto record_in = [&](std::vector<string> &responses){
+    return prpc::transport_send_f([&](string msg){
+      {
+        std::lock_guard<std::mutex> lock(responses_mutex);
+        responses.push_back(msg);
+      }
+      responses_cv.notify_all();
+    });
+  };
+  prpc::transport_send_f first = record_in(first_responses);
+  prpc::transport_send_f second = record_in(second_responses);
+  prpc::invoker srv(nullptr);
+  srv.add("add_one", add_one);
+  srv.add("count_bytes", [](prpc::chunk_range data){
+    std::size_t count = 0;
+    for(std::string_view chunk : data) count += chunk.size();
+    return count;
+  });
+
+  srv.invoke("@1 add_one 1", first);
+  srv.invoke("@1 add_one 2", second);
+  REQUIRE(first_responses == std::vector<string>{"@1 PRPC_GOOD 2"});
+  REQUIRE(second_responses == std::vector<string>{"@1 PRPC_GOOD 3"});
+
+  // Streamed calls with the same correlation ID on two connections don't mix their chunks
+  srv.invoke("@2 count_bytes", first);
+  srv.invoke("@2 count_bytes", second);
+  srv.invoke("@2 prpc-chunk \"abc\"", first);
+  srv.invoke("@2 prpc-chunk \"defgh\"", second);
+  srv.invoke("@2 prpc-chunk-end", second);
+  srv.invoke("@2 prpc-chunk-end", first);
+  {
+    std::unique_lock<std::mutex> lock(responses_mutex);
+    responses_cv.wait(lock, [&]{ return first_responses.size() == 2 && second_responses.size() == 2; });
+  }
+  REQUIRE(first_responses[1] == "@2 PRPC_GOOD 3");
+  REQUIRE(second_responses[1] == "@2 PRPC_GOOD 5");
+
+  std::vector<std::thread> threads;
+  std::atomic<int> good{0};
+  for(int t = 0; t < 4; t++){
+    threads.emplace_back([&srv, &good]{
+      prpc::transport_send_f reply = [&good](string msg){ if(msg == "PRPC_GOOD 42") good++; };
+      for(int i = 0; i < 1000; i++) srv.invoke("add_one 41", reply);
+    });
+  }
+  for(auto &thread : threads) thread.join();
+  REQUIRE(good == 4000);
+
+  // Without a send_fun only the overloads taking a reply can send
+  REQUIRE_THROWS_AS(srv.invoke("add_one 1"), std::logic_error);
+  REQUIRE_THROWS_AS(srv.send_invalidation("add_one"), std::logic_error);
+  std::vector<string> invalidations;
+  srv.send_invalidation("add_one", [&invalidations](string msg){ invalidations.push_back(msg); });
+  REQUIRE(invalidations == std::vector<string>{"PRPC_INVALIDATE \"add_one\""});
+}
+
+TEST_CASE("Pool invoker runs calls on worker threads", "[pool-invoker]"){
+  std::mutex responses_mutex;
+  std::vector<string> responses;
+  auto send = [&](string msg){
+    std::lock_guard<std::mutex> lock(responses_mutex);
+    responses.push_back(msg);
+  };
+
+  SECTION("A slow call doesn't hold up the others"){
+    std::atomic<bool> release_slow{false};
+    prpc::pool_invoker srv(send, 2);
+    srv.add("slow", [&release_slow](){ while(!release_slow) std::this_thread::yield(); });
+    srv.add("add_one", add_one);
+
+    srv.invoke("@1 slow");
+    srv.invoke("@2 add_one 1");
+    while(true){
+      std::lock_guard<std::mutex> lock(responses_mutex);
+      if(!responses.empty()) break;
+    }
+    REQUIRE(responses[0] == "@2 PRPC_GOOD 2");
+    release_slow = true;
+    srv.drain();
+    REQUIRE(responses.size() == 2);
+    REQUIRE(responses[1] == "@1 PRPC_GOOD");
+  }
+
+  SECTION("Calls on the same strand run in order"){
+    std::vector<int> order[4];
+    {
+      prpc::pool_invoker srv(send, 4);
+      srv.add("record", [&order](int strand, int n){ order[strand].push_back(n); });
+      for(int n = 0; n < 200; n++){
+        for(int strand = 0; strand < 4; strand++){
+          srv.invoke("record " + std::to_string(strand) + " " + std::to_string(n), strand);
+        }
+      }
+      srv.drain();
+      REQUIRE(responses.size() == 800);
+    }
+    for(auto &strand_order : order){
+      REQUIRE(strand_order.size() == 200);
+      for(int n = 0; n < 200; n++) REQUIRE(strand_order[n] == n);
+    }
+  }
+
+  SECTION("Functions can be added while calls run"){
+    prpc::pool_invoker srv(send, 4);
+    srv.add("add_one", add_one);
+    for(int n = 0; n < 200; n++){
+      srv.invoke("add_one " + std::to_string(n));
+      srv.add("fun-" + std::to_string(n), get_int);
+    }
+    srv.drain();
+    REQUIRE(responses.size() == 200);
+    for(auto &response : responses) REQUIRE(response.rfind("PRPC_GOOD ", 0) == 0);
+  }
+}
+
+TEST_CASE("Batched calls", "[caller-invoker][batch]"){
+  SECTION("Invoker runs each message in a prpc-batch"){
+    tmp_response = "";
+    prpc::invoker srv(inv_dummy_send);
+    srv.add("add_one", add_one);
+    srv.invoke("@3 prpc-batch \"add_one 1\" \"bogus-fun\" \"add_one x\" \"@5 add_one 2\"");
+    REQUIRE(tmp_response == "@3 PRPC_GOOD \"PRPC_GOOD 2\" \"PRPC_INV_FUN_NOEXIST\" \"PRPC_INV_ARG_EXTRACT_FAILED\" \"@5 PRPC_GOOD 3\"");
+    srv.invoke("prpc-batch");
+    REQUIRE(tmp_response == "PRPC_GOOD");
+    srv.invoke("prpc-batch \"add_one 1");
+    REQUIRE(tmp_response == "PRPC_INV_ARG_EXTRACT_FAILED");
+  }
+
+  SECTION("A batch in a batch is rejected instead of recursing"){
+    tmp_response = "";
+    prpc::invoker srv(inv_dummy_send);
+    srv.add("add_one", add_one);
+    srv.invoke("prpc-batch \"add_one 1\" \"@4 prpc-batch \\\"add_one 2\\\"\"");
+    REQUIRE(tmp_response == "PRPC_GOOD \"PRPC_GOOD 2\" \"@4 PRPC_INV_ARG_EXTRACT_FAILED\"");
+
+    prpc::invoker bin_srv(inv_dummy_send, prpc::wire_format::binary);
+    string message = string{"\x0a" "prpc-batch", 11};
+    for(int depth = 0; depth < 20000; depth++){
+      string entry = message;
+      message = string{"\x0a" "prpc-batch", 11};
+      for(std::size_t len = entry.size(); ; len >>= 7){
+        message += char(len < 0x80 ? len : (len & 0x7f) | 0x80);
+        if(len < 0x80) break;
+      }
+      message += entry;
+    }
+    REQUIRE(message.size() > 200000);
+    bin_srv.invoke(message);
+    REQUIRE(tmp_response == string{"\x09" "PRPC_GOOD" "\x1c" "\x1b" "PRPC_INV_ARG_EXTRACT_FAILED", 39});
+  }
+
+  for(auto format : {prpc::wire_format::text, prpc::wire_format::binary}){
+    int round_trips = 0;
+    invoke = new prpc::invoker(dummy_transport_invoke_send, format);
+    invoke->add("add_one", add_one);
+    invoke->add("concat", concat);
+    invoke->add("get_string", get_string);
+    caller = new prpc::caller([&round_trips](string msg){ round_trips++; return dummy_transport_call_sendrec(msg); }, format);
+
+    auto batch = caller->make_batch();
+    for(int n = 0; n < 10; n++) batch.add("add_one", n);
+    batch.add("concat", "quoted \"string\" ", 4);
+    batch.add("bogus-fn");
+    batch.add("add_one", "not an int");
+    batch.add("get_string");
+    auto results = batch.send();
+    REQUIRE(round_trips == 1);
+    REQUIRE(results.size() == 14);
+
+    for(int n = 0; n < 10; n++){
+      int return_addone = results[n];
+      REQUIRE(return_addone == n + 1);
+    }
+    string return_concat = results[10];
+    REQUIRE(return_concat == "quoted \"string\" 4");
+    REQUIRE(results[11].status() == "PRPC_INV_FUN_NOEXIST");
+    REQUIRE_THROWS_AS(results[11].as<int>(), prpc::UnknownFunctionException);
+    REQUIRE_THROWS_AS(results[12].as<int>(), prpc::BadArgListException);
+    string return_getstring = results[13];
+    REQUIRE(return_getstring == "string with spaces in it");
+  }
+}
+
+TEST_CASE("Static invoker dispatches to compile-time function table", "[static-invoker]"){
+  tmp_response = "";
+  voidintval = -1;
+  prpc::static_invoker<&get_int, &add_one, &concat, &testvoidint> srv(inv_dummy_send, {"get_int", "add_one", "concat", "test-voidint"});
+
+  srv.invoke("get_int");
+  REQUIRE(tmp_response == "PRPC_GOOD 42");
+  srv.invoke("#1 41");
+  REQUIRE(tmp_response == "PRPC_GOOD 42");
+  srv.invoke("@4 concat \"count: \" 4");
+  REQUIRE(tmp_response == "@4 PRPC_GOOD \"count: 4\"");
+  srv.invoke("test-voidint 99");
+  REQUIRE(tmp_response == "PRPC_GOOD");
+  REQUIRE(voidintval == 99);
+  srv.invoke("add_one x");
+  REQUIRE(tmp_response == "PRPC_INV_ARG_EXTRACT_FAILED");
+  srv.invoke("#4");
+  REQUIRE(tmp_response == "PRPC_INV_FUN_NOEXIST");
+  srv.invoke("bogus-fun");
+  REQUIRE(tmp_response == "PRPC_INV_FUN_NOEXIST");
+
+  using duplicate_ids = prpc::static_invoker<&get_int, &add_one>;
+  REQUIRE_THROWS(duplicate_ids(inv_dummy_send, {"get_int", "get_int"}));
+
+  SECTION("Works with caller by numeric ID"){
+    prpc::static_invoker<&get_int, &add_one> bin_srv(inv_dummy_send, prpc::wire_format::binary);
+    prpc::caller cl([&bin_srv](string msg){ bin_srv.invoke(msg); return tmp_response; }, prpc::wire_format::binary);
+    int return_addone = cl.call(1, 10);
+    REQUIRE(return_addone == 11);
+    int return_getint = cl.call(0);
+    REQUIRE(return_getint == 42);
+  }
+}
+
+TEST_CASE("Call results own their response", "[caller-invoker][call-return]"){
+  for(auto format : {prpc::wire_format::text, prpc::wire_format::binary}){
+    invoke = new prpc::invoker(dummy_transport_invoke_send, format);
+    invoke->add("add_one", add_one);
+    invoke->add("echo", echo);
+    caller = new prpc::caller(dummy_transport_call_sendrec, format);
+
+    auto first = caller->call("add_one", 1);
+    auto second = caller->call("add_one", 2);
+    string long_str(1000, 'x');
+    auto third = caller->call("echo", long_str);
+    REQUIRE(first.as<int>() == 2);
+    REQUIRE(second.as<int>() == 3);
+    REQUIRE(first.as<int>() == 2);
+    REQUIRE(third.as<string>() == long_str);
+
+    // A text-format view of an escaped string points to an unescaped copy in the result
+    auto escaped = caller->call("echo", string("a\"b\\c"));
+    std::string_view view = escaped.as<std::string_view>();
+    std::string_view again = escaped.as<std::string_view>();
+    REQUIRE(view == "a\"b\\c");
+    REQUIRE(again == view);
+
+    auto copied = third;
+    auto moved = std::move(first);
+    REQUIRE(copied.as<string>() == long_str);
+    REQUIRE(moved.as<int>() == 2);
+    copied = second;
+    REQUIRE(copied.as<int>() == 3);
+  }
+}
+
+std::vector<int> reverse_ints(std::vector<int> v){ std::reverse(v.begin(), v.end()); return v; }
+std::vector<string> split_words(string s){
+  std::vector<string> words;
+  std::istringstream strm(s);
+  for(string word; strm >> word;) words.push_back(word);
+  return words;
+}
+std::map<string, std::vector<double>> group(std::vector<std::pair<string, double>> items){
+  std::map<string, std::vector<double>> groups;
+  for(auto &[key, value] : items) groups[key].push_back(value);
+  return groups;
+}
+std::optional<int> find_key(std::unordered_map<string, int> m, string key){
+  auto it = m.find(key);
+  if(it == m.end()) return std::nullopt;
+  return it->second;
+}
+std::tuple<int, std::array<double, 3>, std::optional<string>> nested(std::tuple<int, std::array<double, 3>> t, std::optional<string> s){
+  return {std::get<0>(t) + 1, std::get<1>(t), s};
+}
+
+TEST_CASE("STL containers are serialized", "[invoker][containers]"){
+  tmp_response = "";
+  prpc::invoker srv(inv_dummy_send);
+  srv.add("reverse_ints", reverse_ints);
+  srv.add("find_key", find_key);
+
+  SECTION("Text format is a count followed by the elements"){
+    srv.invoke("reverse_ints 3 1 2 3");
+    REQUIRE(tmp_response == "PRPC_GOOD 3 3 2 1");
+    srv.invoke("find_key 2 \"a\" 1 \"b\" 2 \"b\"");
+    REQUIRE(tmp_response == "PRPC_GOOD 1 2");
+    srv.invoke("find_key 0 \"b\"");
+    REQUIRE(tmp_response == "PRPC_GOOD 0");
+  }
+
+  SECTION("Bad counts are rejected"){
+    srv.invoke("reverse_ints 4 1 2 3");
+    REQUIRE(tmp_response == "PRPC_INV_ARG_EXTRACT_FAILED");
+    srv.invoke("reverse_ints 99999999999 1");
+    REQUIRE(tmp_response == "PRPC_INV_ARG_EXTRACT_FAILED");
+  }
+
+  SECTION("Binary arithmetic vectors are one block"){
+    prpc::invoker bin_srv(inv_dummy_send, prpc::wire_format::binary);
+    bin_srv.add("reverse_ints", reverse_ints);
+    bin_srv.invoke(string{"\x0c" "reverse_ints" "\x02\x01\x00\x00\x00\x02\x00\x00\x00", 22});
+    REQUIRE(tmp_response == string{"\x09" "PRPC_GOOD" "\x02\x02\x00\x00\x00\x01\x00\x00\x00", 19});
+    bin_srv.invoke(string{"\x0c" "reverse_ints" "\x03\x01\x00\x00\x00\x02\x00\x00\x00", 22});
+    REQUIRE(tmp_response == string{"\x1b" "PRPC_INV_ARG_EXTRACT_FAILED"});
+  }
+}
+
+TEST_CASE("STL containers round trip through caller", "[caller-invoker][containers]"){
+  for(auto format : {prpc::wire_format::text, prpc::wire_format::binary}){
+    invoke = new prpc::invoker(dummy_transport_invoke_send, format);
+    invoke->add("reverse_ints", reverse_ints);
+    invoke->add("split_words", split_words);
+    invoke->add("group", group);
+    invoke->add("find_key", find_key);
+    invoke->add("nested", nested);
+    caller = new prpc::caller(dummy_transport_call_sendrec, format);
+
+    auto reversed = caller->call("reverse_ints", std::vector<int>{1, -2, 3}).as<std::vector<int>>();
+    REQUIRE(reversed == std::vector<int>{3, -2, 1});
+    auto empty = caller->call("reverse_ints", std::vector<int>{}).as<std::vector<int>>();
+    REQUIRE(empty.empty());
+
+    auto words = caller->call("split_words", "a \"quoted\" sentence").as<std::vector<string>>();
+    REQUIRE(words == std::vector<string>{"a", "\"quoted\"", "sentence"});
+
+    std::vector<std::pair<string, double>> items{{"x", 0.5}, {"y", 1.0}, {"x", 2.0}};
+    auto groups = caller->call("group", items).as<std::map<string, std::vector<double>>>();
+    REQUIRE(groups.size() == 2);
+    REQUIRE(groups["x"] == std::vector<double>{0.5, 2.0});
+    REQUIRE(groups["y"] == std::vector<double>{1.0});
+
+    std::unordered_map<string, int> m{{"one", 1}, {"two", 2}};
+    REQUIRE(caller->call("find_key", m, "two").as<std::optional<int>>() == 2);
+    REQUIRE_FALSE(caller->call("find_key", m, "three").as<std::optional<int>>());
+
+    auto result = caller->call("nested", std::make_tuple(1, std::array<double, 3>{1.5, 2.5, 3.5}), std::optional<string>("s s"));
+    auto [n, arr, opt] = result.as<std::tuple<int, std::array<double, 3>, std::optional<string>>>();
+    REQUIRE(n == 2);
+    REQUIRE(arr == std::array<double, 3>{1.5, 2.5, 3.5});
+    REQUIRE(opt == "s s");
+  }
+}
+
+std::string_view echo_view(std::string_view s){ return s; }
+
+TEST_CASE("Quoting matches std::quoted byte for byte", "[invoker][quoting]"){
+  string response;
+  prpc::invoker srv(inv_dummy_send);
+  srv.add("echo", echo);
+  srv.add("echo_view", echo_view);
+  std::mt19937 rng(12);
+  string const alphabet = "ab \"\\\t\n";
+
+  // Lengths cross the 16 and 32 byte scan widths, specials land in and between blocks
+  for(std::size_t len = 0; len < 100; ++len){
+    string s;
+    for(std::size_t i = 0; i < len; ++i)
+      s += rng() % 4 ? 'a' + char(rng() % 26) : alphabet[rng() % alphabet.size()];
+    std::ostringstream quoted;
+    quoted << std::quoted(s);
+
+    srv.invoke("echo " + quoted.str(), response);
+    REQUIRE(response == "PRPC_GOOD " + quoted.str());
+    srv.invoke("echo_view " + quoted.str(), response);
+    REQUIRE(response == "PRPC_GOOD " + quoted.str());
+  }
+
+  string clean(70, 'x');
+  srv.invoke("echo \"" + clean + "\\", response);
+  REQUIRE(response == "PRPC_INV_ARG_EXTRACT_FAILED");
+  srv.invoke("echo \"" + clean, response);
+  REQUIRE(response == "PRPC_INV_ARG_EXTRACT_FAILED");
+  srv.invoke("echo \"" + clean + "\\q\"", response);
+  REQUIRE(response == "PRPC_GOOD \"" + clean + "q\"");
+  srv.invoke("echo unquoted", response);
+  REQUIRE(response == "PRPC_GOOD \"unquoted\"");
+}
+
+struct comma_numpunct : std::numpunct<char>{
+  char do_decimal_point() const override { return ','; }
+  char do_thousands_sep() const override { return '.'; }
+  std::string do_grouping() const override { return "\3"; }
+};
+
+TEST_CASE("Text numbers round trip exactly and ignore the global locale", "[caller-invoker][numbers]"){
+  auto old_locale = std::locale::global(std::locale(std::locale::classic(), new comma_numpunct));
+  string response;
+  prpc::invoker srv(inv_dummy_send);
+  srv.add("half", half);
+  srv.add("add_one", add_one);
+  prpc::caller cl([&srv](std::string_view msg, string &resp){ srv.invoke(msg, resp); });
+
+  srv.invoke("half 1234567.5", response);
+  REQUIRE(response == "PRPC_GOOD 617283.75");
+  srv.invoke("add_one 1234567", response);
+  REQUIRE(response == "PRPC_GOOD 1234568");
+  srv.invoke("add_one +41", response);
+  REQUIRE(response == "PRPC_GOOD 42");
+  srv.invoke("add_one 99999999999", response);
+  REQUIRE(response == "PRPC_INV_ARG_EXTRACT_FAILED");
+  srv.invoke("add_one x1", response);
+  REQUIRE(response == "PRPC_INV_ARG_EXTRACT_FAILED");
+
+  for(double d : {0.1, 1.0 / 3, 2e-308, 5e-324, 1.7976931348623157e308, -123456.789012345678}){
+    double result = cl.call("half", d);
+    REQUIRE(result == d / 2);
+  }
+  REQUIRE(std::isinf(double(cl.call("half", HUGE_VAL))));
+  std::locale::global(old_locale);
+}
+
+std::size_t count_char(string c, prpc::chunk_range data){
+  std::size_t count = 0;
+  for(std::string_view chunk : data) count += std::count(chunk.begin(), chunk.end(), c.at(0));
+  return count;
+}
+std::size_t first_chunk_size(prpc::chunk_range data){
+  for(std::string_view chunk : data) return chunk.size();
+  return 0;
+}
+prpc::chunk_source repeat(string s, int n){
+  return prpc::chunk_source([s, n](string &chunk) mutable {
+    if(n-- <= 0) return false;
+    chunk = s;
+    return true;
+  });
+}
+
+TEST_CASE("Streamed arguments and results are sent in chunks", "[caller-invoker][streaming]"){
+  for(auto format : {prpc::wire_format::text, prpc::wire_format::binary}){
+    prpc::async_caller *cl = nullptr;
+    prpc::invoker srv([&cl](string msg){ cl->receive(msg); }, format);
+    srv.add("count_char", count_char);
+    srv.add("first_chunk_size", first_chunk_size);
+    srv.add("repeat", repeat);
+    std::size_t messages = 0;
+    prpc::async_caller async_cl([&](string msg){ messages++; srv.invoke(msg); }, format);
+    cl = &async_cl;
+
+    string payload(1 << 20, 'a');
+    payload[12345] = '"';
+    payload[1 << 19] = '\\';
+    std::size_t count = cl->call_async("count_char", "a", prpc::chunk_source::split(payload, 4096)).get();
+    REQUIRE(count == payload.size() - 2);
+    REQUIRE(messages == 2 + payload.size() / 4096);
+
+    // The function returns before reading the rest, which is dropped
+    std::size_t size = cl->call_async("first_chunk_size", prpc::chunk_source::split(payload, 1000)).get();
+    REQUIRE(size == 1000);
+
+    string received;
+    std::size_t chunks = 0;
+    auto done = cl->call_chunked([&](std::string_view chunk){ received += chunk; chunks++; }, "repeat", "a\"b", 1000);
+    REQUIRE(done.get().status() == "PRPC_GOOD");
+    REQUIRE(chunks == 1000);
+    REQUIRE(received.size() == 3000);
+    REQUIRE(received.substr(0, 6) == "a\"ba\"b");
+    REQUIRE(cl->in_flight() == 0);
+  }
+
+  SECTION("Without a push transport chunks are joined and streamed args fail"){
+    string response;
+    prpc::invoker srv(inv_dummy_send);
+    srv.add("count_char", count_char);
+    srv.add("repeat", repeat);
+    srv.invoke("repeat ab 3", response);
+    REQUIRE(response == "PRPC_GOOD \"ababab\"");
+    srv.invoke("count_char a", response);
+    REQUIRE(response == "PRPC_INV_ARG_EXTRACT_FAILED");
+    srv.invoke("count_char a");
+    REQUIRE(tmp_response == "PRPC_INV_ARG_EXTRACT_FAILED");
+  }
+
+  SECTION("A blocking caller over invoke(string) gets the chunks joined"){
+    std::deque<string> sent;
+    prpc::invoker srv([&sent](string msg){ sent.push_back(std::move(msg)); });
+    srv.add("repeat", repeat);
+    srv.add("add_one", add_one);
+    prpc::caller cl([&](string msg){
+      srv.invoke(std::move(msg));
+      string response = sent.front();
+      sent.pop_front();
+      return response;
+    });
+    REQUIRE(cl.call("repeat", "ab", 3).as<string>() == "ababab");
+    REQUIRE(sent.empty());
+    REQUIRE(cl.call("add_one", 1).as<int>() == 2);
+  }
+}
+
+TEST_CASE("Cached functions answer repeated calls without running", "[invoker][cache]"){
+  int calls = 0;
+  auto lookup = [&calls](int key){ calls++; return key * 10; };
+  auto failing = [&calls](int key){ calls++; if(key < 0) throw std::runtime_error("negative"); return key; };
+
+  SECTION("Hits, correlation IDs and invalidation"){
+    string response;
+    prpc::invoker srv(inv_dummy_send);
+    srv.add("lookup", lookup, prpc::cache_options{16});
+    srv.add("failing", failing, prpc::cache_options{16});
+    srv.add("uncached", lookup);
+
+    srv.invoke("lookup 3", response);
+    REQUIRE(response == "PRPC_GOOD 30");
+    srv.invoke("lookup 3", response);
+    REQUIRE(response == "PRPC_GOOD 30");
+    srv.invoke("@7 lookup 3", response);
+    REQUIRE(response == "@7 PRPC_GOOD 30");
+    srv.invoke("lookup 4", response);
+    REQUIRE(response == "PRPC_GOOD 40");
+    REQUIRE(calls == 2);
+    auto stats = srv.get_cache_stats("lookup");
+    REQUIRE(stats.hits == 2);
+    REQUIRE(stats.misses == 2);
+    REQUIRE(stats.size == 2);
+
+    srv.invalidate("lookup");
+    srv.invoke("lookup 3", response);
+    REQUIRE(response == "PRPC_GOOD 30");
+    REQUIRE(calls == 3);
+
+    // Errors are not cached
+    srv.invoke("failing -1", response);
+    srv.invoke("failing -1", response);
+    REQUIRE(response == "PRPC_INV_EXCEPT negative");
+    srv.invoke("failing x", response);
+    REQUIRE(response == "PRPC_INV_ARG_EXTRACT_FAILED");
+    REQUIRE(calls == 5);
+    REQUIRE(srv.get_cache_stats("failing").size == 0);
+
+    srv.invoke("uncached 3", response);
+    srv.invoke("uncached 3", response);
+    REQUIRE(calls == 7);
+    REQUIRE(srv.get_cache_stats("uncached").misses == 0);
+    REQUIRE_THROWS(srv.add("repeat", repeat, prpc::cache_options{16}));
+  }
+
+  SECTION("Least recently used responses are evicted and old ones expire"){
+    for(auto format : {prpc::wire_format::text, prpc::wire_format::binary}){
+      calls = 0;
+      prpc::invoker srv(inv_dummy_send, format);
+      srv.add("lookup", lookup, prpc::cache_options{2});
+      srv.add("expiring", lookup, prpc::cache_options{2, std::chrono::milliseconds(20)});
+      prpc::caller cl([&srv](std::string_view msg, string &resp){ srv.invoke(msg, resp); }, format);
+
+      REQUIRE(int(cl.call("lookup", 1)) == 10);
+      REQUIRE(int(cl.call("lookup", 2)) == 20);
+      REQUIRE(int(cl.call("lookup", 1)) == 10);
+      REQUIRE(int(cl.call("lookup", 3)) == 30);
+      REQUIRE(calls == 3);
+      REQUIRE(int(cl.call("lookup", 1)) == 10);
+      REQUIRE(calls == 3);
+      REQUIRE(int(cl.call("lookup", 2)) == 20);
+      REQUIRE(calls == 4);
+
+      REQUIRE(int(cl.call("expiring", 1)) == 10);
+      REQUIRE(int(cl.call("expiring", 1)) == 10);
+      REQUIRE(calls == 5);
+      std::this_thread::sleep_for(std::chrono::milliseconds(30));
+      REQUIRE(int(cl.call("expiring", 1)) == 10);
+      REQUIRE(calls == 6);
+    }
+  }
+}
+
+TEST_CASE("Caller memoizes results until they expire or are invalidated", "[caller-invoker][memoize]"){
+  for(auto format : {prpc::wire_format::text, prpc::wire_format::binary}){
+    std::vector<string> pushed;
+    prpc::invoker srv([&pushed](string msg){ pushed.push_back(msg); }, format);
+    int calls = 0;
+    srv.add("config", [&calls](string key){ calls++; return key + "=1"; });
+    srv.add("counter", [&calls](){ return ++calls; });
+    srv.add("add_one", add_one);
+    std::size_t round_trips = 0;
+    prpc::caller cl([&](std::string_view msg, string &resp){ round_trips++; srv.invoke(msg, resp); }, format);
+    cl.memoize("config", prpc::cache_options{8});
+    cl.memoize("prpc-get-version", prpc::cache_options{1, std::chrono::milliseconds(20)});
+
+    REQUIRE(cl.call("config", "a").as<string>() == "a=1");
+    REQUIRE(cl.call("config", "a").as<string>() == "a=1");
+    REQUIRE(cl.call("config", "b").as<string>() == "b=1");
+    REQUIRE(calls == 2);
+    REQUIRE(round_trips == 2);
+    REQUIRE(cl.get_cache_stats("config").hits == 1);
+    REQUIRE(cl.call("counter").as<int>() == 3);
+    REQUIRE(cl.call("counter").as<int>() == 4);
+    REQUIRE_THROWS_AS(cl.call("add_one", "x"), prpc::BadArgListException);
+    REQUIRE(cl.get_cache_stats("add_one").misses == 0);
+
+    // Numeric IDs share the memo, keyed on their own serialized calls
+    cl.fetch_fun_nums();
+    round_trips = 0;
+    REQUIRE(cl.call("config", "c").as<string>() == "c=1");
+    REQUIRE(cl.call("config", "c").as<string>() == "c=1");
+    REQUIRE(round_trips == 1);
+
+    REQUIRE(cl.call("prpc-get-version").as<string>() == PRPC_VERSION_STR);
+    REQUIRE(cl.call("prpc-get-version").as<string>() == PRPC_VERSION_STR);
+    REQUIRE(round_trips == 2);
+    std::this_thread::sleep_for(std::chrono::milliseconds(30));
+    REQUIRE(cl.call("prpc-get-version").as<string>() == PRPC_VERSION_STR);
+    REQUIRE(round_trips == 3);
+
+    srv.send_invalidation("config");
+    REQUIRE(pushed.size() == 1);
+    REQUIRE(cl.receive_invalidation(pushed[0]));
+    REQUIRE(cl.get_cache_stats("config").size == 0);
+    REQUIRE(cl.call("config", "c").as<string>() == "c=1");
+    REQUIRE(round_trips == 4);
+
+    srv.send_invalidation();
+    REQUIRE(cl.receive_invalidation(pushed[1]));
+    REQUIRE(cl.get_cache_stats("config").size == 0);
+    REQUIRE(cl.get_cache_stats("prpc-get-version").size == 0);
+    srv.invoke("add_one 1");
+    REQUIRE_FALSE(cl.receive_invalidation(pushed[2]));
+  }
+}
+
+TEST_CASE("Invoker counts calls, errors, bytes and latency per function", "[invoker][stats]"){
+  SECTION("Histogram buckets"){
+    using stats = prpc::function_stats;
+    for(std::uint64_t ns : {0ull, 7ull, 8ull, 15ull, 16ull, 17ull, 1000ull, 123456789ull, ~0ull}){
+      auto bucket = stats::bucket_of(ns);
+      REQUIRE(bucket < stats::buckets);
+      REQUIRE(stats::bucket_max(bucket) >= ns);
+      if(bucket > 0) REQUIRE(stats::bucket_max(bucket - 1) < ns);
+    }
+    REQUIRE(stats::bucket_of(~0ull) == stats::buckets - 1);
+  }
+
+  for(auto format : {prpc::wire_format::text, prpc::wire_format::binary}){
+    prpc::invoker srv(inv_dummy_send, format);
+    srv.add("add_one", add_one);
+    srv.add("throws", [](){ throw std::runtime_error("no"); });
+    prpc::caller cl([&srv](std::string_view msg, string &resp){ srv.invoke(msg, resp); }, format);
+
+    for(int i = 0; i < 10; i++) REQUIRE(int(cl.call("add_one", i)) == i + 1);
+    REQUIRE_THROWS(cl.call("add_one", "x"));
+    REQUIRE_THROWS(cl.call("throws"));
+    REQUIRE_THROWS(cl.call("bogus"));
+
+    auto stats = srv.get_stats();
+    auto &add_stats = stats.at("add_one");
+    REQUIRE(add_stats.calls == 11);
+    REQUIRE(add_stats.errors.at("PRPC_INV_ARG_EXTRACT_FAILED") == 1);
+    REQUIRE(add_stats.errors.count("PRPC_INV_EXCEPT") == 0);
+    REQUIRE(add_stats.bytes_in > 11 * 7);
+    REQUIRE(add_stats.bytes_out > 10 * 9);
+    REQUIRE(add_stats.latency_percentile(0.5) <= add_stats.latency_percentile(0.99));
+    REQUIRE(add_stats.latency_percentile(1) == add_stats.max_latency_ns);
+    REQUIRE(add_stats.max_latency_ns > 0);
+    REQUIRE(stats.at("throws").errors.at("PRPC_INV_EXCEPT") == 1);
+    REQUIRE(stats.at("prpc-get-version").calls == 0);
+    REQUIRE(srv.get_unknown_calls() == 1);
+
+    auto rows = cl.call("prpc-get-stats").as<std::vector<prpc::stats_row>>();
+    auto row = std::find_if(rows.begin(), rows.end(), [](auto &r){ return std::get<0>(r) == "add_one"; });
+    REQUIRE(row != rows.end());
+    REQUIRE(std::get<1>(*row) == 11);
+    REQUIRE(std::get<2>(*row) == 1);
+    REQUIRE(std::get<3>(*row) == 0);
+    REQUIRE(std::get<8>(*row) == add_stats.max_latency_ns);
+  }
+
+  prpc::invoker srv(inv_dummy_send);
+  srv.invoke("prpc-get-next-function");
+  REQUIRE(tmp_response == "PRPC_GOOD \"PRPC_FUNLIST_END\"");
+}
+
+TEST_CASE("Queue invoker takes messages from many threads without a lock", "[queue-invoker]"){
+  std::mutex responses_mutex;
+  std::vector<string> responses;
+  auto send = [&](string msg){
+    std::lock_guard<std::mutex> lock(responses_mutex);
+    responses.push_back(msg);
+  };
+
+  SECTION("Every message from every producer is answered"){
+    prpc::queue_invoker srv(send, 2, 16);
+    srv.add("add_one", add_one);
+    std::vector<std::thread> producers;
+    for(int t = 0; t < 4; t++){
+      producers.emplace_back([&srv, t]{
+        for(int i = 0; i < 500; i++) srv.invoke("@" + std::to_string(t * 1000 + i) + " add_one " + std::to_string(i));
+      });
+    }
+    for(auto &producer : producers) producer.join();
+    srv.drain();
+
+    REQUIRE(responses.size() == 2000);
+    std::sort(responses.begin(), responses.end());
+    REQUIRE(std::adjacent_find(responses.begin(), responses.end()) == responses.end());
+    REQUIRE(std::count(responses.begin(), responses.end(), "@3499 PRPC_GOOD 500") == 1);
+    REQUIRE(std::count(responses.begin(), responses.end(), "@0 PRPC_GOOD 1") == 1);
+  }
+
+  SECTION("Messages with the same key run in order"){
+    std::vector<int> seen;
+    {
+      prpc::queue_invoker srv(send, 3);
+      srv.add("record", [&seen](int n){ seen.push_back(n); });
+      for(int i = 0; i < 1000; i++) srv.invoke("record " + std::to_string(i), 7);
+    }
+    REQUIRE(seen.size() == 1000);
+    REQUIRE(std::is_sorted(seen.begin(), seen.end()));
+    REQUIRE(responses.size() == 1000);
+  }
+}
+
+TEST_CASE("Functions can be added and removed during live traffic", "[invoker][registry]"){
+  string response;
+  prpc::invoker srv(inv_dummy_send);
+  auto add_one_num = srv.add("add_one", add_one);
+
+  SECTION("Removed functions stop existing, their numeric IDs aren't reused"){
+    REQUIRE(srv.remove("add_one"));
+    REQUIRE_FALSE(srv.remove("add_one"));
+    srv.invoke("add_one 1", response);
+    REQUIRE(response == "PRPC_INV_FUN_NOEXIST");
+    srv.invoke("#" + std::to_string(add_one_num) + " 1", response);
+    REQUIRE(response == "PRPC_INV_FUN_NOEXIST");
+    auto readded = srv.add("add_one", add_one);
+    REQUIRE(readded != add_one_num);
+    srv.invoke("add_one 1", response);
+    REQUIRE(response == "PRPC_GOOD 2");
+  }
+
+  SECTION("Lookups find every function through growth and removals"){
+    std::vector<prpc::fun_num_t> nums;
+    for(int i = 0; i < 1000; i++) nums.push_back(srv.add("fun_" + std::to_string(i), get_int));
+    for(int i = 0; i < 1000; i += 2) REQUIRE(srv.remove("fun_" + std::to_string(i)));
+    for(int i = 0; i < 1000; i += 4) srv.add("fun_" + std::to_string(i), get_int);
+    for(int i = 0; i < 1000; i++){
+      bool exists = i % 2 == 1 || i % 4 == 0;
+      srv.invoke("fun_" + std::to_string(i), response);
+      REQUIRE(response == (exists ? "PRPC_GOOD 42" : "PRPC_INV_FUN_NOEXIST"));
+      srv.invoke("#" + std::to_string(nums[i]), response);
+      REQUIRE(response == (i % 2 == 1 ? "PRPC_GOOD 42" : "PRPC_INV_FUN_NOEXIST"));
+    }
+    srv.invoke("add_one 1", response);
+    REQUIRE(response == "PRPC_GOOD 2");
+  }
+
+  SECTION("A function can add to its own invoker"){
+    srv.add("register", [&srv](string fun_id){ return srv.add(fun_id, get_int); });
+    srv.invoke("register get_int", response);
+    srv.invoke("get_int", response);
+    REQUIRE(response == "PRPC_GOOD 42");
+  }
+
+  SECTION("Calls on other threads see every function that exists throughout"){
+    std::atomic<bool> stop{false};
+    std::atomic<int> failures{0};
+    std::vector<std::thread> readers;
+    for(int t = 0; t < 3; t++){
+      readers.emplace_back([&]{
+        prpc::serial_buffer thread_response;
+        while(!stop){
+          srv.invoke("add_one 41", thread_response);
+          if(thread_response.view() != "PRPC_GOOD 42") failures++;
+        }
+      });
+    }
+    for(int i = 0; i < 200; i++){
+      string fun_id = "plugin_" + std::to_string(i % 10);
+      srv.remove(fun_id);
+      srv.add(fun_id, get_int);
+    }
+    stop = true;
+    for(auto &reader : readers) reader.join();
+    REQUIRE(failures == 0);
+    srv.invoke("plugin_3", response);
+    REQUIRE(response == "PRPC_GOOD 42");
+  }
+}
+
+TEST_CASE("TCP transport carries calls over localhost", "[caller-invoker][tcp]"){
+  prpc::tcp_loop loop;
+  auto format = prpc::wire_format::text;
+  std::uint16_t port = loop.listen(0, [format](prpc::transport_send_f send){
+    auto srv = std::make_shared<prpc::invoker>(std::move(send), format);
+    srv->add("add_one", add_one);
+    srv->add("echo", echo);
+    return [srv](string msg){ srv->invoke(std::move(msg)); };
+  });
+  std::thread loop_thread([&loop]{ loop.run(); });
+
+  SECTION("Blocking caller"){
+    prpc::tcp_client client("localhost", port);
+    prpc::caller cl([&client](string msg){ return client.sendrec(std::move(msg)); }, format);
+    int result = cl.call("add_one", 41);
+    REQUIRE(result == 42);
+    string big(1000000, 'x');
+    string echoed = cl.call("echo", big);
+    REQUIRE(echoed == big);
+  }
+
+  SECTION("Pipelined calls are answered in order"){
+    prpc::tcp_client client("127.0.0.1", port);
+    for(int i = 0; i < 100; i++) client.send("add_one " + std::to_string(i));
+    for(int i = 0; i < 100; i++) REQUIRE(client.receive() == "PRPC_GOOD " + std::to_string(i + 1));
+  }
+
+  SECTION("The loop drops a connection that announces a frame over tcp_max_frame_size"){
+    int raw = prpc::_tcp_connect("127.0.0.1", port);
+    string oversize = "\xff\xff\xff\xff" + string(100000, 'x');
+    REQUIRE(write(raw, oversize.data(), oversize.size()) > 0);
+    char byte;
+    REQUIRE(read(raw, &byte, 1) <= 0);
+    close(raw);
+  }
+
+  SECTION("Blocking client refuses a frame over tcp_max_frame_size"){
+    std::uint16_t raw_port = 0;
+    int listener = prpc::_tcp_listen("127.0.0.1", raw_port);
+    prpc::tcp_client client("127.0.0.1", raw_port);
+    int peer;
+    while((peer = accept(listener, nullptr, nullptr)) < 0) std::this_thread::yield();
+    char const length[4] = {'\xff', '\xff', '\xff', '\xff'};
+    REQUIRE(write(peer, length, 4) == 4);
+    REQUIRE_THROWS_AS(client.receive(), std::system_error);
+    close(peer);
+    close(listener);
+  }
+
+  SECTION("One loop thread serves many connections"){
+    constexpr int connection_count = 500;
+    prpc::tcp_loop client_loop;
+    std::vector<std::unique_ptr<prpc::async_caller>> callers(connection_count);
+    for(auto &cl : callers){
+      auto send = client_loop.connect("127.0.0.1", port, [&cl](string msg){ cl->receive(std::move(msg)); });
+      cl = std::make_unique<prpc::async_caller>(std::move(send), format);
+    }
+    std::thread client_thread([&client_loop]{ client_loop.run(); });
+
+    std::vector<std::future<prpc::call_return>> results;
+    for(int i = 0; i < connection_count; i++) results.push_back(callers[i]->call_async("add_one", i));
+    for(int i = 0; i < connection_count; i++){
+      int value = results[i].get();
+      REQUIRE(value == i + 1);
+    }
+    REQUIRE(loop.connections() == connection_count);
+
+    client_loop.stop();
+    client_thread.join();
+  }
+
+  loop.stop();
+  loop_thread.join();
+}
+
+TEST_CASE("Shared-memory transport carries calls between threads", "[caller-invoker][shm]"){
+  for(auto format : {prpc::wire_format::text, prpc::wire_format::binary}){
+    // Small rings so that long messages go through in pieces
+    auto server = prpc::shm_channel::create({}, 4096);
+    std::thread server_thread([&server, format]{
+      prpc::invoker srv([&server](string msg){ server.send(msg); }, format);
+      srv.add("add_one", add_one);
+      srv.add("echo", echo);
+      string request;
+      while(server.receive(request)) srv.invoke(std::move(request));
+    });
+
+    auto client = prpc::shm_channel::open(server.get_fd());
+    prpc::caller cl([&client](std::string_view msg, string &response){ client.sendrec(msg, response); }, format);
+    for(int i = 0; i < 1000; i++){
+      int result = cl.call("add_one", i);
+      REQUIRE(result == i + 1);
+    }
+    string big(100000, 'x');
+    big[5000] = '"';
+    string echoed = cl.call("echo", big);
+    REQUIRE(echoed == big);
+
+    client.close();
+    server_thread.join();
+    REQUIRE_THROWS(client.send("add_one 1"));
+  }
+
+  SECTION("Named segments"){
+    string name = "/prpc-test-" + std::to_string(getpid());
+    auto server = prpc::shm_channel::create(name);
+    REQUIRE_THROWS(prpc::shm_channel::create(name));
+    auto client = prpc::shm_channel::open(name);
+    client.send("ping");
+    string message;
+    REQUIRE(server.receive(message));
+    REQUIRE(message == "ping");
+  }
+
+  SECTION("A length over shm_max_message_size closes the channel"){
+    auto server = prpc::shm_channel::create({}, 4096);
+    std::size_t size = sizeof(prpc::_shm_header) + 2 * 4096;
+    void *addr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, server.get_fd(), 0);
+    REQUIRE(addr != MAP_FAILED);
+    // A peer writing a request of 4 GiB - 1 bytes
+    auto header = static_cast<prpc::_shm_header*>(addr);
+    std::memset(header + 1, 0xff, 4);
+    header->rings[0].head.store(4);
+    string message;
+    REQUIRE_FALSE(server.receive(message));
+    REQUIRE(message.empty());
+    REQUIRE_THROWS(server.send("ping"));
+    munmap(addr, size);
+  }
+}
+
+TEST_CASE("io_uring transport carries calls, or falls back to epoll", "[caller-invoker][tcp][uring]"){
+  for(bool try_io_uring : {true, false}){
+    prpc::uring_loop loop(try_io_uring);
+    if(!try_io_uring) REQUIRE_FALSE(loop.uses_io_uring());
+    std::uint16_t port = loop.listen(0, [](prpc::transport_send_f send){
+      auto srv = std::make_shared<prpc::invoker>(std::move(send));
+      srv->add("add_one", add_one);
+      srv->add("echo", echo);
+      return [srv](string msg){ srv->invoke(std::move(msg)); };
+    });
+    std::thread loop_thread([&loop]{ loop.run(); });
+
+    {
+      prpc::tcp_client client("127.0.0.1", port);
+      for(int i = 0; i < 100; i++) client.send("add_one " + std::to_string(i));
+      for(int i = 0; i < 100; i++) REQUIRE(client.receive() == "PRPC_GOOD " + std::to_string(i + 1));
+      // Larger than a receive buffer
+      prpc::caller cl([&client](string msg){ return client.sendrec(std::move(msg)); });
+      string big(200000, 'x');
+      string echoed = cl.call("echo", big);
+      REQUIRE(echoed == big);
+    }
+
+    constexpr int connection_count = 200;
+    prpc::uring_loop client_loop(try_io_uring);
+    std::vector<std::unique_ptr<prpc::async_caller>> callers(connection_count);
+    for(auto &cl : callers){
+      auto send = client_loop.connect("127.0.0.1", port, [&cl](string msg){ cl->receive(std::move(msg)); });
+      cl = std::make_unique<prpc::async_caller>(std::move(send));
+    }
+    std::thread client_thread([&client_loop]{ client_loop.run(); });
+    std::vector<std::future<prpc::call_return>> results;
+    for(int i = 0; i < connection_count; i++) results.push_back(callers[i]->call_async("add_one", i));
+    for(int i = 0; i < connection_count; i++){
+      int value = results[i].get();
+      REQUIRE(value == i + 1);
+    }
+    client_loop.stop();
+    client_thread.join();
+
+    loop.stop();
+    loop_thread.join();
+  }
+}
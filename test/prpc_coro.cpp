@@ -0,0 +1,120 @@
+// Copyright (C) 2021 Stuart Duncan
+//
+// This file is part of PicoRPC.
+//
+// PicoRPC is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// PicoRPC is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with PicoRPC.  If not, see <http://www.gnu.org/licenses/>.
+
+
+// Coroutine functions and awaited calls, built as C++20
+#include "catch.hpp"
+#include "prpc.hpp"
+#include <vector>
+
+using std::string;
+
+TEST_CASE("Coroutine functions respond when their task finishes", "[invoker][coroutine]"){
+  prpc::event_loop loop;
+  std::vector<string> responses;
+  prpc::invoker srv([&responses](string msg){ responses.push_back(msg); });
+  srv.add("add_later", [&loop](int a, int b) -> prpc::task<int> {
+    co_await loop.yield();
+    co_return a + b;
+  });
+  srv.add("fail_later", [&loop]() -> prpc::task<> {
+    co_await loop.yield();
+    throw std::runtime_error("fail");
+  });
+  srv.add("add_now", [](int a) -> prpc::task<int> { co_return a + 1; });
+  srv.add("throw_int", []() -> prpc::task<> {
+    throw 42;
+    co_return;
+  });
+
+  srv.invoke("@1 add_later 2 3");
+  srv.invoke("@2 fail_later");
+  srv.invoke("@3 add_later x 3");
+  srv.invoke("@4 add_now 1");
+  REQUIRE(responses == std::vector<string>{"@3 PRPC_INV_ARG_EXTRACT_FAILED", "@4 PRPC_GOOD 2"});
+
+  REQUIRE(loop.run() == 2);
+  REQUIRE(responses.size() == 4);
+  REQUIRE(responses[2] == "@1 PRPC_GOOD 5");
+  REQUIRE(responses[3] == "@2 PRPC_INV_EXCEPT fail");
+  REQUIRE(srv.get_stats()["add_later"].calls == 2);
+
+  string response;
+  srv.invoke("add_now 1", response);
+  REQUIRE(response.rfind("PRPC_INV_EXCEPT", 0) == 0);
+
+  // Not a std::exception, still answered instead of terminating
+  srv.invoke("@5 throw_int");
+  REQUIRE(responses.back() == "@5 PRPC_INV_EXCEPT unknown exception");
+  REQUIRE_THROWS(srv.add("cached", [](int a) -> prpc::task<int> { co_return a; }, prpc::cache_options{4}));
+}
+
+TEST_CASE("Coroutines await calls without blocking", "[caller-invoker][coroutine]"){
+  for(auto format : {prpc::wire_format::text, prpc::wire_format::binary}){
+    prpc::event_loop loop;
+    // Every message goes through the loop, as if it came from a socket
+    prpc::async_caller *downstream_cl = nullptr;
+    prpc::invoker downstream([&](string msg){ loop.post([&, msg]{ downstream_cl->receive(msg); }); }, format);
+    prpc::async_caller downstream_caller([&](string msg){ loop.post([&, msg]{ downstream.invoke(msg); }); }, format);
+    downstream_cl = &downstream_caller;
+    downstream.add("double", [](int a){ return a * 2; });
+
+    prpc::async_caller *front_cl = nullptr;
+    prpc::invoker front([&](string msg){ loop.post([&, msg]{ front_cl->receive(msg); }); }, format);
+    prpc::async_caller front_caller([&](string msg){ loop.post([&, msg]{ front.invoke(msg); }); }, format);
+    front_cl = &front_caller;
+    front.add("double_plus_one", [&](int a) -> prpc::task<int> {
+      int doubled = co_await downstream_caller.call("double", a);
+      co_return doubled + 1;
+    });
+
+    std::vector<int> results;
+    bool unknown_thrown = false;
+    auto client = [&](int count) -> prpc::task<> {
+      for(int i = 0; i < count; i++) results.push_back(co_await front_caller.call("double_plus_one", i));
+      try{
+        co_await front_caller.call("bogus-fn");
+      }catch(prpc::UnknownFunctionException &){
+        unknown_thrown = true;
+      }
+    };
+    loop.spawn(client(3));
+    loop.spawn(client(2));
+    loop.run();
+
+    std::sort(results.begin(), results.end());
+    REQUIRE(results == std::vector<int>{1, 1, 3, 3, 5});
+    REQUIRE(unknown_thrown);
+    REQUIRE(front_caller.in_flight() == 0);
+    REQUIRE(downstream_caller.in_flight() == 0);
+  }
+
+  SECTION("A response that arrives before the caller suspends"){
+    prpc::async_caller *cl = nullptr;
+    prpc::invoker srv([&cl](string msg){ cl->receive(msg); });
+    prpc::async_caller direct([&srv](string msg){ srv.invoke(msg); });
+    cl = &direct;
+    srv.add("add_one", [](int a){ return a + 1; });
+
+    prpc::event_loop loop;
+    int result = 0;
+    auto client = [&]() -> prpc::task<> { result = co_await direct.call("add_one", 41); };
+    loop.spawn(client());
+    REQUIRE(loop.run() == 1);
+    REQUIRE(result == 42);
+  }
+}